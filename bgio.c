@@ -24,6 +24,7 @@
 #include <termios.h>
 
 #include "bgio.h"
+#include "io/io.h"
 #include "log.h"
 #include "cmd.h"
 #include "util.h"
@@ -38,7 +39,7 @@ static struct winsize st_window;			// current winsize of terminal
 
 
 
-static void window_resize(int dummy)
+static void window_resize(int sig, void *refcon)
 {
 	ioctl(0, TIOCGWINSZ, (char*)&st_window);
 	ioctl(st_slave_fd, TIOCSWINSZ, (char*)&st_window);
@@ -162,7 +163,9 @@ int bgio_start()
 		bail(fork_error3);
 	}
 
-	signal(SIGWINCH, window_resize);
+	if(io_signal_add(SIGWINCH, window_resize, NULL) < 0) {
+		log_warn("Could not watch SIGWINCH, window resizes will be ignored");
+	}
 
 	return st_master_fd;
 }
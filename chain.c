@@ -0,0 +1,280 @@
+/* chain.c
+ * Scott Bronson
+ *
+ * A chain is a list of segments that point into refcounted slabs.
+ * Unlike a fifo, a chain can be handed from one owner to another, or
+ * split in two, just by moving pointers.  This is used to carry data
+ * across task switches without copying it.
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "chain.h"
+#include "util.h"
+
+
+// Slabs are allocated at least this big so that lots of little
+// appends don't each need their own slab.
+#define CHAIN_SLAB_SIZE 4096
+
+
+void chain_init(struct chain *c)
+{
+	c->head = c->tail = NULL;
+	c->count = 0;
+}
+
+
+static struct chain_slab* slab_create(int size)
+{
+	struct chain_slab *slab;
+
+	if(size < CHAIN_SLAB_SIZE) {
+		size = CHAIN_SLAB_SIZE;
+	}
+
+	slab = malloc(sizeof(struct chain_slab) + size);
+	if(slab == NULL) {
+		perror("allocating chain slab");
+		bail(60);
+	}
+
+	slab->refs = 0;
+	slab->size = size;
+	slab->used = 0;
+
+	return slab;
+}
+
+
+static void slab_release(struct chain_slab *slab)
+{
+	assert(slab->refs > 0);
+	slab->refs -= 1;
+	if(slab->refs == 0) {
+		free(slab);
+	}
+}
+
+
+static struct chain_seg* seg_create(struct chain_slab *slab, char *buf, int len)
+{
+	struct chain_seg *seg = malloc(sizeof(struct chain_seg));
+	if(seg == NULL) {
+		perror("allocating chain segment");
+		bail(61);
+	}
+
+	seg->next = NULL;
+	seg->slab = slab;
+	seg->buf = buf;
+	seg->len = len;
+	slab->refs += 1;
+
+	return seg;
+}
+
+
+static void seg_destroy(struct chain_seg *seg)
+{
+	slab_release(seg->slab);
+	free(seg);
+}
+
+
+static void chain_add_tail(struct chain *c, struct chain_seg *seg)
+{
+	if(c->tail) {
+		c->tail->next = seg;
+	} else {
+		c->head = seg;
+	}
+	c->tail = seg;
+	c->count += seg->len;
+}
+
+
+void chain_destroy(struct chain *c)
+{
+	struct chain_seg *seg, *next;
+
+	for(seg=c->head; seg; seg=next) {
+		next = seg->next;
+		seg_destroy(seg);
+	}
+
+	chain_init(c);
+}
+
+
+/** Copies cnt bytes onto the end of the chain.  If the last segment
+ *  owns the end of its slab and there's room left over, the data
+ *  goes there.
+ */
+
+void chain_append(struct chain *c, const char *buf, int cnt)
+{
+	struct chain_seg *seg = c->tail;
+	struct chain_slab *slab;
+	int n;
+
+	if(cnt <= 0) {
+		return;
+	}
+
+	if(seg && seg->slab->refs == 1 &&
+			seg->buf + seg->len == seg->slab->data + seg->slab->used) {
+		n = seg->slab->size - seg->slab->used;
+		if(n > cnt) n = cnt;
+		memcpy(seg->buf + seg->len, buf, n);
+		seg->len += n;
+		seg->slab->used += n;
+		c->count += n;
+		buf += n;
+		cnt -= n;
+	}
+
+	if(cnt > 0) {
+		slab = slab_create(cnt);
+		memcpy(slab->data, buf, cnt);
+		slab->used = cnt;
+		chain_add_tail(c, seg_create(slab, slab->data, cnt));
+	}
+}
+
+
+/** Copies cnt bytes onto the start of the chain. */
+
+void chain_prepend(struct chain *c, const char *buf, int cnt)
+{
+	struct chain_slab *slab;
+	struct chain_seg *seg;
+
+	if(cnt <= 0) {
+		return;
+	}
+
+	slab = slab_create(cnt);
+	memcpy(slab->data, buf, cnt);
+	slab->used = cnt;
+
+	seg = seg_create(slab, slab->data, cnt);
+	seg->next = c->head;
+	c->head = seg;
+	if(c->tail == NULL) {
+		c->tail = seg;
+	}
+	c->count += cnt;
+}
+
+
+/** Moves all the data in src onto the end of dst.  Only the list
+ *  pointers change, so this takes the same time no matter how much
+ *  data is in src.  src is left empty.
+ */
+
+void chain_move(struct chain *dst, struct chain *src)
+{
+	if(chain_empty(src)) {
+		return;
+	}
+
+	if(dst->tail) {
+		dst->tail->next = src->head;
+	} else {
+		dst->head = src->head;
+	}
+	dst->tail = src->tail;
+	dst->count += src->count;
+
+	chain_init(src);
+}
+
+
+/** Moves the first cnt bytes of src onto the end of dst.  If the
+ *  split point falls in the middle of a segment, both chains end
+ *  up sharing that segment's slab.
+ */
+
+void chain_split(struct chain *src, int cnt, struct chain *dst)
+{
+	struct chain_seg *seg;
+
+	assert(cnt <= src->count);
+
+	while(cnt > 0) {
+		seg = src->head;
+		if(seg->len <= cnt) {
+			src->head = seg->next;
+			if(src->head == NULL) {
+				src->tail = NULL;
+			}
+			src->count -= seg->len;
+			cnt -= seg->len;
+			seg->next = NULL;
+			chain_add_tail(dst, seg);
+		} else {
+			chain_add_tail(dst, seg_create(seg->slab, seg->buf, cnt));
+			seg->buf += cnt;
+			seg->len -= cnt;
+			src->count -= cnt;
+			cnt = 0;
+		}
+	}
+}
+
+
+/** Throws away the first cnt bytes in the chain. */
+
+void chain_consume(struct chain *c, int cnt)
+{
+	struct chain_seg *seg;
+
+	assert(cnt <= c->count);
+
+	while(cnt > 0) {
+		seg = c->head;
+		if(seg->len <= cnt) {
+			c->head = seg->next;
+			if(c->head == NULL) {
+				c->tail = NULL;
+			}
+			c->count -= seg->len;
+			cnt -= seg->len;
+			seg_destroy(seg);
+		} else {
+			seg->buf += cnt;
+			seg->len -= cnt;
+			c->count -= cnt;
+			cnt = 0;
+		}
+	}
+}
+
+
+/** Fills iov with the first max segments in the chain, suitable
+ *  for passing to writev.
+ *
+ *  @returns the number of iovecs filled in.
+ */
+
+int chain_iov(struct chain *c, struct iovec *iov, int max)
+{
+	struct chain_seg *seg;
+	int n = 0;
+
+	for(seg=c->head; seg && n < max; seg=seg->next) {
+		iov[n].iov_base = seg->buf;
+		iov[n].iov_len = seg->len;
+		n++;
+	}
+
+	return n;
+}
@@ -0,0 +1,54 @@
+/* chain.h
+ * Scott Bronson
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+struct iovec;
+
+/* A slab is a refcounted block of memory.  Several segments (possibly
+ * in different chains) can point into the same slab.
+ */
+
+struct chain_slab {
+	int refs;
+	int size;
+	int used;
+	char data[];
+};
+
+struct chain_seg {
+	struct chain_seg *next;
+	struct chain_slab *slab;
+	char *buf;
+	int len;
+};
+
+struct chain {
+	struct chain_seg *head;
+	struct chain_seg *tail;
+	int count;					// total bytes in the chain
+};
+
+
+#define chain_empty(c)		((c)->head == NULL)
+#define chain_count(c)		((c)->count)
+
+void chain_init(struct chain *c);
+void chain_destroy(struct chain *c);
+
+/* copy a memory block onto the end or the start of the chain */
+void chain_append(struct chain *c, const char *buf, int cnt);
+void chain_prepend(struct chain *c, const char *buf, int cnt);
+
+/* moves all of src onto the end of dst without copying any data */
+void chain_move(struct chain *dst, struct chain *src);
+/* moves the first cnt bytes of src onto the end of dst */
+void chain_split(struct chain *src, int cnt, struct chain *dst);
+
+/* throws away the first cnt bytes in the chain */
+void chain_consume(struct chain *c, int cnt);
+
+/* fills up to max iovecs with the chain's data, returns the number used */
+int chain_iov(struct chain *c, struct iovec *iov, int max);
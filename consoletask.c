@@ -5,14 +5,13 @@
  * Automatically installs the echo task as its first task.
  *
  * TODO: get rid of st_child_pid
- * TODO: stdio is not reentrant.  Can't call log_XX from a signal
- * handler.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
 #include <unistd.h>
 #ifdef __APPLE__
     #include <limits.h>
@@ -23,10 +22,10 @@
     #include <pty.h>
 #endif
 #include <sys/types.h>
-#include <sys/wait.h>
 
 #include "log.h"
 #include "bgio.h"
+#include "chain.h"
 #include "fifo.h"
 #include "io/io.h"
 #include "pipe.h"
@@ -38,51 +37,19 @@
     #define MAXINT (1ull << ((8 * sizeof(int)) - 2))
 #endif
 
-static int sigchild_received;
+static io_child shell_child;
 
 
-static void sigchild(int tt)
-{
-	// Don't want to handle the child here as it could lead to races.
-	// The signal causes select to return early so we'll handle it
-	// before doing any I/O.
-	log_dbg("Got a sigchild!  sigchild_received=%d->%d", sigchild_received, sigchild_received+1);
-	sigchild_received++;
-}
-
-
-static void sigpipe(int tt)
+static void master_sigpipe(int sig, void *refcon)
 {
 	log_dbg("Got a sigpipe!");
 }
 
 
-void master_check_sigchild(master_pipe *mp)
-{
-    int pid, status;
-
-	if(!sigchild_received) {
-		return;
-	}
-
-    // Wait for the child that caused this signal
-    log_dbg("Got sigchld");
-    pid = waitpid(-1, &status, WNOHANG);
-    log_dbg(" ... pid=%d status=%d", pid, status);
-    if(pid <= 0) {
-        log_wtf("waitpid returned %d?! errno=%d (%s)", pid, errno, strerror(errno));
-        return;
-    }
-
-	// dispatch it through the pipe
-    task_dispatch_sigchild(mp, pid);
-	sigchild_received = 0;
-}
-
-
 static void master_pipe_destructor(master_pipe *mp, int free_mem)
 {
 	master_pipe_default_destructor(mp, free_mem);
+	io_child_del(&shell_child);
 
 	if(free_mem) {
 		bgio_stop();
@@ -113,20 +80,28 @@ static void master_terminate(master_pipe *mp)
 }
 
 
-static void master_pipe_sigchild(master_pipe *mp, int pid)
+/** Called from the event loop when our child shell has exited.
+ *  It runs after the fd events for the same trip through the loop
+ *  so the shell's last output has already been read.
+ */
+
+static void master_shell_exited(int pid, int status, void *refcon)
 {
-	if(pid == st_child_pid) {
-		// our child shell has disappeared.
-		// Kill off all tasks.  The removal of the last task will
-		// trigger the destructor which leaps directly home.
-		while(mp->task_head) {
-			task_remove(mp);
-		}
+	master_pipe *mp = refcon;
+
+	log_dbg("shell %d exited, status=%d", pid, status);
+
+	// Kill off all tasks.  The removal of the last task will
+	// trigger the destructor which leaps directly home.
+	while(mp->task_head) {
+		task_remove(mp);
 	}
 }
 
 
-/** Idles the topmost task on the master pipe.
+/** Checks the master pipe before the loop goes to sleep.  Returns
+ *  how long io_wait may sleep.  Tasks' periodic work is done with
+ *  io_timers so io_wait takes care of waking up for that.
  */
 
 int master_idle(master_pipe *mp)
@@ -141,14 +116,14 @@ int master_idle(master_pipe *mp)
 		}
 	}
 
-	task_spec *spec = mp->task_head->spec;
-	return spec->idle_proc ? (*spec->idle_proc)(spec) : MAXINT;
+	return MAXINT;
 }
 
 
 master_pipe* master_setup(int fd)
 {
 	master_pipe *mp;
+	int err;
 
 	if(fd < 0) {
 		// no socket, so open a tty
@@ -164,11 +139,20 @@ master_pipe* master_setup(int fd)
 		bail(49);
 	}
 	mp->destruct_proc = master_pipe_destructor;
-	mp->sigchild_proc = master_pipe_sigchild;
 	mp->terminate_proc = master_terminate;
 
-	signal(SIGCHLD, sigchild);
-	signal(SIGPIPE, sigpipe);
+	if(io_signal_add(SIGPIPE, master_sigpipe, NULL) < 0) {
+		perror("watching for signals");
+		bail(48);
+	}
+
+	if(st_child_pid > 0) {
+		err = io_child_add(&shell_child, st_child_pid, master_shell_exited, mp);
+		if(err < 0) {
+			fprintf(stderr, "watching shell: %s\n", strerror(-err));
+			bail(47);
+		}
+	}
 
 	return mp;
 }
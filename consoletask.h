@@ -1,4 +1,3 @@
 int master_idle();
 master_pipe* master_setup(int sockfd);
-void master_check_sigchild(master_pipe *mp);
 
@@ -19,11 +19,13 @@
 
 #include "log.h"
 #include "bgio.h"
+#include "chain.h"
 #include "fifo.h"
 #include "io/io.h"
 #include "pipe.h"
 #include "task.h"
 #include "rztask.h"
+#include "zseq.h"
 #include "zrq.h"
 #include "util.h"
 
@@ -63,13 +65,27 @@ static task_spec *echo_create_spec()
 /////////////////  Echo Scanner
 
 
+// Called when the terminal has been sent everything that came before
+// the zmodem start sequence.  The receiver gets everything after it.
+// That has been waiting in the fifo without a proc so the receive
+// task's proc still needs to look at it (it might hold the ZFIN).
+
+static void echo_scanner_marked(struct pipe *pipe, void *refcon)
+{
+	// the refcon is the master_pipe
+	rztask_install(refcon);
+	fifo_refeed(&pipe->fifo, fifo_beg_pos(&pipe->fifo), pipe->read_atom->atom.fd);
+}
+
+
 // This routine is called when the zrq scanner discovers the zmodem
 // start sequence.
 
 static void echo_scanner_start_proc(void *refcon)
 {
-	// the refcon is the master_pipe
-	rztask_install(refcon);
+	master_pipe *mp = refcon;
+
+	pipe_mark(&mp->master_output, echo_scanner_marked, mp);
 }
 
 
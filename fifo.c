@@ -11,29 +11,254 @@
  * TODO: This is only half-finished.  Now that it's pretty clear what
  * the requirements are, the API should really be cleaned up.  Especially
  * the stupid filter proc.
+ *
+ * If the fifo's size is a multiple of the page size, its storage is
+ * mapped twice, back to back, so the pages that follow the buffer are
+ * the buffer again.  That way the data in the fifo (and the free space)
+ * is always one contiguous span no matter where it wraps.  If the system
+ * can't do that, the fifo falls back to an ordinary malloc'd ring.
+ *
+ * Fifos are elastic: they start out at their initial size, inflate
+ * (see fifo_grow) when the writer can't keep up, and deflate again
+ * once they've drained (fifo_shrink).  Once a fifo gets bigger than
+ * fifo_spill_size, its storage moves to a temporary file.
  */
 
+#define _GNU_SOURCE	// for memfd_create and O_TMPFILE
+
 #include <assert.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "fifo.h"
+#include "filter.h"
+#include "io/io.h"
 #include "log.h"
+#include "util.h"
 
 
 #define LOG_BUFFER_CONTENTS 0
 
 
-/* name is an arbitrary name for the fifo */
-struct fifo *fifo_init(struct fifo *f, int initsize)
+/** Fifos bigger than this are stored in an unlinked temporary file
+ *  rather than in memory so the kernel can write them out to disk.
+ */
+
+int fifo_spill_size = 1024*1024;
+
+
+/** Returns an fd for size bytes of anonymous shared memory or -1. */
+
+static int fifo_shm_open(int size)
+{
+	int fd = -1;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create("rzh-fifo", MFD_CLOEXEC);
+#endif
+
+	if(fd < 0) {
+		// no memfd, try posix shm.  we unlink it immediately
+		// so nothing is left lying around if we crash.
+		char name[64];
+		snprintf(name, sizeof(name), "/rzh-fifo-%ld-%lx",
+				(long)getpid(), (long)&name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if(fd < 0) {
+			return -1;
+		}
+		shm_unlink(name);
+	}
+
+	if(ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/** Returns an fd for an unlinked temporary file of size bytes or -1. */
+
+static int fifo_spill_open(int size)
+{
+	char name[PATH_MAX];
+	const char *dir = getenv("TMPDIR");
+	int fd = -1;
+
+	if(dir == NULL || dir[0] == '\0') {
+		dir = "/tmp";
+	}
+
+#ifdef O_TMPFILE
+	fd = open(dir, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+#endif
+
+	if(fd < 0) {
+		snprintf(name, sizeof(name), "%s/rzh-fifo-XXXXXX", dir);
+		fd = mkstemp(name);
+		if(fd < 0) {
+			return -1;
+		}
+		unlink(name);
+	}
+
+	if(ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/** Maps the file fd twice, back to back.
+ *  Returns NULL if it can't be done (the caller should use malloc).
+ */
+
+static char* fifo_mirror_map(int fd, int size)
+{
+	char *base, *p;
+
+	// reserve enough address space for both copies, then map
+	// the shared memory over each half.
+	base = mmap(NULL, 2*size, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED) {
+		return NULL;
+	}
+
+	p = mmap(base, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0);
+	if(p == base) {
+		p = mmap(base+size, size, PROT_READ|PROT_WRITE,
+				MAP_SHARED|MAP_FIXED, fd, 0);
+	}
+
+	if(p == MAP_FAILED) {
+		munmap(base, 2*size);
+		return NULL;
+	}
+
+	return base;
+}
+
+
+/** Allocates the storage for a fifo of the given size.  Page-sized
+ *  fifos are mirrored if possible, everything else is malloc'd.
+ *  Sets *mirrored to tell which.  Returns NULL if out of memory.
+ */
+
+static char* fifo_alloc(int size, int *mirrored)
+{
+	long pagesize = sysconf(_SC_PAGESIZE);
+	char *buf = NULL;
+	int fd;
+
+	*mirrored = 0;
+	if(pagesize > 0 && size % pagesize == 0) {
+		fd = -1;
+		if(size > fifo_spill_size) {
+			fd = fifo_spill_open(size);
+			if(fd < 0) {
+				log_warn("Couldn't create spill file for %d byte fifo: %s",
+						size, strerror(errno));
+			}
+		}
+		if(fd < 0) {
+			fd = fifo_shm_open(size);
+		}
+		if(fd >= 0) {
+			buf = fifo_mirror_map(fd, size);
+			close(fd);
+		}
+		if(buf) {
+			*mirrored = 1;
+			return buf;
+		}
+		log_dbg("Couldn't mirror fifo of size %d, using malloc", size);
+	}
+
+	return (char*)malloc(size);
+}
+
+
+static void fifo_free(char *buf, int size, int mirrored)
+{
+	if(mirrored) {
+		munmap(buf, 2*size);
+	} else {
+		free(buf);
+	}
+}
+
+
+/* rounds n up to the next power of two */
+static int fifo_pow2(int n)
+{
+	int size = 1;
+
+	while(size < n) {
+		size <<= 1;
+	}
+
+	return size;
+}
+
+
+/* copies cnt bytes into the ring starting at stream position pos */
+static void fifo_put(struct fifo *f, uint64_t pos, const char *buf, int cnt)
 {
+	int i = fifo_index(f, pos);
+	int n = f->size - i;
+
+	if(cnt > n && !f->mirrored) {
+		memmove(f->buf + i, buf, n);
+		memmove(f->buf, buf + n, cnt - n);
+	} else {
+		memmove(f->buf + i, buf, cnt);
+	}
+}
+
+
+/* copies cnt bytes out of the ring starting at stream position pos */
+static void fifo_get(struct fifo *f, uint64_t pos, char *buf, int cnt)
+{
+	int i = fifo_index(f, pos);
+	int n = f->size - i;
+
+	if(cnt > n && !f->mirrored) {
+		memcpy(buf, f->buf + i, n);
+		memcpy(buf + n, f->buf, cnt - n);
+	} else {
+		memcpy(buf, f->buf + i, cnt);
+	}
+}
+
+
+/* Sizes are rounded up to a power of two. */
+struct fifo *fifo_init(struct fifo *f, int initsize, int maxsize)
+{
+	initsize = fifo_pow2(initsize);
 	f->size = initsize;
+	f->initsize = initsize;
+	f->maxsize = maxsize > initsize ? fifo_pow2(maxsize) : initsize;
 	f->beg = f->end = 0;
-	f->buf = (char*)malloc(initsize);
 	f->proc = NULL;
+	f->peek = NULL;
+	f->filters = NULL;
+	f->pendbuf = NULL;
+	f->pendcnt = 0;
+	f->scratch = NULL;
+	f->held = 0;
+
+	f->buf = fifo_alloc(initsize, &f->mirrored);
 	if(f->buf == NULL) return NULL;
 
 	return f;
@@ -42,30 +267,97 @@ struct fifo *fifo_init(struct fifo *f, int initsize)
 
 void fifo_destroy(struct fifo *f)
 {
-	free(f->buf);
+	if(f->buf) {
+		fifo_free(f->buf, f->size, f->mirrored);
+	}
+	f->buf = NULL;
+	free(f->scratch);
+	f->scratch = NULL;
 }
 
 
-/* erase all data in the fifo */
-void fifo_clear(struct fifo *f)
+/** Moves the fifo's data into new storage of the given size.
+ *  The data keeps its stream positions.
+ *  Returns 0 on success, -1 if the memory couldn't be allocated
+ *  (in which case the fifo is left as it was).
+ *
+ *  This must not be called from a fifo proc.
+ */
+
+static int fifo_resize(struct fifo *f, int size)
 {
-	f->beg = f->end = 0;
+	struct iovec iov[2];
+	struct fifo old = *f;
+	uint64_t pos = f->beg;
+	int i, n;
+
+	assert(fifo_count(f) <= size);
+	assert(f->pendcnt == 0);
+
+	f->buf = fifo_alloc(size, &f->mirrored);
+	if(f->buf == NULL) {
+		log_warn("Couldn't resize fifo from %d to %d bytes", old.size, size);
+		*f = old;
+		return -1;
+	}
+	f->size = size;
+
+	n = fifo_iov(&old, iov);
+	for(i=0; i<n; i++) {
+		fifo_put(f, pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	log_dbg("Resized %s fifo from %d to %d bytes holding %d",
+			f->mirrored ? "mirrored" : "malloc", old.size, size, fifo_count(f));
+
+	fifo_free(old.buf, old.size, old.mirrored);
+	free(f->scratch);
+	f->scratch = NULL;
+
+	return 0;
 }
 
 
-/* returns the number of bytes in the fifo */
-// TODO can get rid of first f->size right?
-int fifo_count(struct fifo *f)
+/** Inflates the fifo until it has room for at least cnt more bytes.
+ *  The fifo doubles in size until it's big enough, but it never
+ *  grows past its maxsize.
+ *
+ *  @returns the number of bytes now available.  This is less than
+ *  cnt if the fifo has hit its maxsize or memory ran out.
+ */
+
+int fifo_grow(struct fifo *f, int cnt)
 {
-	return (f->size + f->end - f->beg) % f->size;
+	int need = fifo_count(f) + f->held + cnt;
+	int size = f->size;
+
+	while(size < need && size < f->maxsize) {
+		size <<= 1;
+	}
+
+	if(size > f->size) {
+		fifo_resize(f, size);
+	}
+
+	return fifo_avail(f);
+}
+
+
+/** Deflates an empty fifo back to its initial size. */
+
+void fifo_shrink(struct fifo *f)
+{
+	if(fifo_empty(f) && f->size > f->initsize) {
+		fifo_resize(f, f->initsize);
+	}
 }
 
 
-/* returns the amount of free space left in the fifo */
-// TODO can get rid of first f->size right?
-int fifo_avail(struct fifo *f)
+/* erase all data in the fifo.  The stream positions keep counting. */
+void fifo_clear(struct fifo *f)
 {
-	return (f->size + f->beg - f->end - 1) % f->size;
+	f->beg = f->end;
 }
 
 
@@ -73,8 +365,8 @@ int fifo_avail(struct fifo *f)
 /* make sure there's room before calling! */
 void fifo_unsafe_addchar(struct fifo *f, char c)
 {
-	f->buf[f->end++] = c;
-	if(f->end == f->size) f->end = 0;
+	f->buf[fifo_index(f, f->end)] = c;
+	f->end++;
 }
 
 
@@ -82,25 +374,115 @@ void fifo_unsafe_addchar(struct fifo *f, char c)
 /* make sure there's data in the fifo before calling! */
 int fifo_unsafe_getchar(struct fifo *f)
 {
-	int c = f->buf[f->beg++];
-	if(f->beg == f->size) f->beg = 0;
+	int c = f->buf[fifo_index(f, f->beg)];
+	f->beg++;
 	return c;
 }
 
 
+/* returns true if p points into the fifo's storage (or its mirror) */
+static int fifo_contains(struct fifo *f, const char *p)
+{
+	return p >= f->buf && p < f->buf + (f->mirrored ? 2 : 1) * f->size;
+}
+
+
 /* dangerously add a block of data to the fifo */
 /* make sure there's room before calling! */
+/* buf may point into the fifo's free space (i.e. a fifo proc is
+ * passing on data that fifo_read put there).  If it's already in
+ * the right place we don't need to copy it at all. */
 void fifo_unsafe_append(struct fifo *f, const char *buf, int cnt)
 {
-	if(f->end + cnt > f->size) {
-		int n = f->size - f->end;
-		memcpy(f->buf+f->end, buf, n);
-		memcpy(f->buf, buf+n, cnt - n);
+	const char *p = f->buf + fifo_index(f, f->end);
+
+	// (p + size is only the same byte if the fifo is mirrored)
+	if(buf != p && !(f->mirrored && buf == p + f->size)) {
+		fifo_put(f, f->end, buf, cnt);
+	}
+
+	f->end += cnt;
+}
+
+
+/** Hands data to the fifo's proc.  Without a proc the data is kept
+ *  as is.  This is where the output of the last filter goes.
+ */
+
+void fifo_unsafe_feed(struct fifo *f, const char *buf, int size, int fd)
+{
+	if(f->proc) {
+		(*f->proc)(f, buf, size, fd);
+	} else if(size > 0) {
+		fifo_unsafe_append(f, buf, size);
+	}
+}
+
+
+/* Runs freshly read data through the filters, then the proc. */
+static void fifo_filter(struct fifo *f, const char *buf, int size, int fd)
+{
+	if(f->filters) {
+		filter_run(f, buf, size, fd);
 	} else {
-		memcpy(f->buf+f->end, buf, cnt);
+		fifo_unsafe_feed(f, buf, size, fd);
 	}
+}
+
 
-	f->end = (f->end + cnt) % f->size;
+/** Makes room for a fifo proc to add cnt bytes that didn't come from
+ *  its input.  *cp and *ce delimit the input that the proc hasn't
+ *  scanned yet.  Normally that input is sitting in the fifo's free
+ *  space, just past where the appended data will go, so there's
+ *  no room to insert anything until the proc has dropped at least
+ *  as much as it wants to add.  If it hasn't, we move the unscanned
+ *  input (and any input that fifo_read hasn't handed to the proc yet)
+ *  out of the way and point *cp and *ce at the new location.
+ *
+ *  This only happens when a proc inserts data, which is rare.
+ */
+
+void fifo_unsafe_reserve(struct fifo *f, const char **cp, const char **ce, int cnt)
+{
+	int room = f->size;
+	int n, pend = 0;
+
+	if(fifo_contains(f, *cp)) {
+		room = fifo_index(f, *cp - f->buf - f->end);
+	}
+	if(f->pendcnt > 0 && fifo_contains(f, f->pendbuf)) {
+		n = fifo_index(f, f->pendbuf - f->buf - f->end);
+		if(n < room) room = n;
+		pend = f->pendcnt;
+	}
+	if(cnt <= room) {
+		return;
+	}
+
+	// The input can never be bigger than the fifo so the scratch
+	// buffer doesn't need to be any bigger either.
+	if(f->scratch == NULL) {
+		f->scratch = malloc(f->size);
+		if(f->scratch == NULL) {
+			perror("allocating fifo scratch");
+			bail(98);
+		}
+	}
+
+	n = 0;
+	if(fifo_contains(f, *cp)) {
+		n = *ce - *cp;
+		memcpy(f->scratch, *cp, n);
+		*cp = f->scratch;
+		*ce = f->scratch + n;
+	}
+	if(pend) {
+		memcpy(f->scratch + n, f->pendbuf, pend);
+		f->pendbuf = f->scratch + n;
+	}
+
+	log_dbg("Moved %d bytes of unscanned input out of the way of %d new bytes",
+			n + pend, cnt);
 }
 
 
@@ -108,15 +490,8 @@ void fifo_unsafe_append(struct fifo *f, const char *buf, int cnt)
 /* make sure there's room before calling! */
 void fifo_unsafe_prepend(struct fifo *f, const char *buf, int cnt)
 {
-	if(f->beg < cnt) {
-		int n = cnt - f->beg;
-		memcpy(f->buf, buf + n, f->beg);
-		memcpy(f->buf + f->size - n, buf, n);
-		f->beg = f->size - n;
-	} else {
-		f->beg -= cnt;
-		memcpy(f->buf + f->beg, buf, cnt);
-	}
+	f->beg -= cnt;
+	fifo_put(f, f->beg, buf, cnt);
 }
 
 
@@ -124,15 +499,8 @@ void fifo_unsafe_prepend(struct fifo *f, const char *buf, int cnt)
 /* make sure there's data in the fifo before calling! */
 void fifo_unsafe_unpend(struct fifo *f, char *buf, int cnt)
 {
-	if(f->beg + cnt > f->size) {
-		int n = f->size - f->beg;
-		memcpy(buf, f->buf+f->beg, n);
-		memcpy(buf+n, f->buf, cnt - n);
-	} else {
-		memcpy(buf, f->buf+f->beg, cnt);
-	}
-
-	f->beg = (f->beg + cnt) % f->size;
+	fifo_get(f, f->beg, buf, cnt);
+	f->beg += cnt;
 }
 
 /*
@@ -182,6 +550,11 @@ void logio(char *gr1, char* gr2, int fd, const char *buf, int cnt, int act)
 {
 	int n = act, i;
 
+	if(n > cnt) {
+		// only cnt bytes of buf are valid (the rest wrapped)
+		n = cnt;
+	}
+
 	if(n >= 0) {
 		// print the first few bytes.
 		i = n;
@@ -213,40 +586,105 @@ void logio(char *gr1, char* gr2, int fd, const char *buf, int cnt, int act)
 #endif
 
 
-/** Partially fill the fifo by calling read().
+/** Fills iov with the cnt bytes of the ring that start at stream
+ *  position pos.  Returns the number of iovecs used (0, 1 or 2).
+ *  A mirrored fifo never needs more than one.
+ */
+
+static int fifo_span_iov(struct fifo *f, uint64_t pos, int cnt, struct iovec *iov)
+{
+	int i = fifo_index(f, pos);
+	int n = f->size - i;
+
+	if(cnt == 0) {
+		return 0;
+	}
+
+	iov[0].iov_base = f->buf + i;
+	if(cnt <= n || f->mirrored) {
+		iov[0].iov_len = cnt;
+		return 1;
+	}
+
+	iov[0].iov_len = n;
+	iov[1].iov_base = f->buf;
+	iov[1].iov_len = cnt - n;
+	return 2;
+}
+
+
+/* Fills iov with the free space in the fifo, leaving room in front
+ * for the bytes that the proc is holding (see fifo_proc).  Filters
+ * move the input anyway so there's no point to the gap with them.
+ */
+
+static int fifo_free_iov(struct fifo *f, struct iovec *iov)
+{
+	int gap = (f->proc && !f->filters) ? f->held : 0;
+	return fifo_span_iov(f, f->end + gap, fifo_avail(f), iov);
+}
+
+
+/* Hands cnt bytes of input sitting in the fifo's free space to the
+ * filters and proc.  The input may be split over the two iovecs.
+ * Returns the number of bytes the proc kept.
+ */
+
+static int fifo_filter_iov(struct fifo *f, struct iovec *iov, int cnt, int fd)
+{
+	uint64_t old = f->end;
+	const char *buf;
+	int n;
+
+	n = cnt < iov[0].iov_len ? cnt : iov[0].iov_len;
+	f->pendbuf = cnt > n ? iov[1].iov_base : NULL;
+	f->pendcnt = cnt - n;
+	fifo_filter(f, iov[0].iov_base, n, fd);
+
+	if(f->pendcnt > 0) {
+		// The proc may have been changed or fifo_unsafe_reserve may
+		// have moved the data so don't use iov[1] directly.
+		buf = f->pendbuf;
+		n = f->pendcnt;
+		f->pendcnt = 0;
+		fifo_filter(f, buf, n, fd);
+	}
+
+	return (int)(f->end - old);
+}
+
+
+/** Partially fill the fifo by calling readv().
+ *
+ * The data is read directly into the fifo's free space.  If there's
+ * a filter proc, it's handed the data where it lies and filters it
+ * in place (see fifo_proc).  If the free space wraps, the proc is
+ * called once for each piece.
  *
  * @returns the number of bytes read (0 is a valid number; it means
  * that the filter proc ate all the data).
  *
- * TODO:
- *  Only performs a single read call.  We should probably read to exhaustion.
- *  So, the first read must not return EAGAIN.  After the first read, we keep
- *  reading until we get EAGAIN.
- *
- * TODO: get rid of the copy.
- * TODO: make it resize the fifo if necessary to try to exhaust the read
+ * Only performs a single read call.  pipe_auto_read calls it
+ * repeatedly to read to exhaustion, inflating the fifo as needed.
  */
 
 int fifo_read(struct fifo *f, int fd)
 {
-	char buf[BUFSIZ];
+	struct iovec iov[2];
 	int cnt, n;
 
-	cnt = fifo_avail(f);
-	if(cnt > sizeof(buf)) {
-		cnt = sizeof(buf);
-	}
+	n = fifo_free_iov(f, iov);
+	assert(n > 0);
 
 	do {
 		errno = 0;
-		n = read(fd, buf, cnt);
-		if(n == -1) {
+		cnt = io_readv(fd, iov, n);
+		if(cnt == -1) {
 			log_dbg("Error reading %d for fifo: %d (%s)", fd, errno, strerror(errno));
 		}
-	} while(n == -1 && errno == EINTR);
+	} while(cnt == -1 && errno == EINTR);
 
-	logio("Read", "from", fd, buf, cnt, n);
-	cnt = n;
+	logio("Read", "from", fd, iov[0].iov_base, iov[0].iov_len, cnt);
 
 	if(cnt < 0) {
 		// We had better not be told that there's no data to read!
@@ -260,31 +698,75 @@ int fifo_read(struct fifo *f, int fd)
 		cnt = -2;
 	}
 
-
-	if(f->proc) {
-		int old = fifo_avail(f);
-		(*f->proc)(f, buf, cnt, fd);
+	if(!f->proc && !f->filters) {
+		// the data is already where it belongs
 		if(cnt > 0) {
-			cnt = old - fifo_avail(f);
-		}
-		if(cnt >= 0) {
-			log_info("RProc copied %d into %d, count is now %d.", cnt, fd,
-					fifo_count(f));
-		} else {
-			log_err("RProc returned %d for %d.", cnt, fd);
+			f->end += cnt;
 		}
+		return cnt;
+	}
+
+	if(cnt <= 0) {
+		fifo_filter(f, f->buf + fifo_index(f, f->end), cnt, fd);
 	} else {
-		// copy the read data into the buffer
-		if(cnt > 0) {
-			fifo_unsafe_append(f, buf, cnt);
-		}
+		cnt = fifo_filter_iov(f, iov, cnt, fd);
+	}
+
+	if(cnt >= 0) {
+		log_info("RProc copied %d into %d, count is now %d.", cnt, fd,
+				fifo_count(f));
+	} else {
+		log_err("RProc returned %d for %d.", cnt, fd);
+	}
+
+	return cnt;
+}
+
+
+/** Takes back the data from stream position pos to the end of the
+ *  fifo and runs it through the filters and proc as if fifo_read had
+ *  just read it.  This is for data that went into the fifo while it
+ *  had no proc, now that it has one (see echotask.c).
+ *
+ *  @returns the number of bytes the proc kept.
+ */
+
+int fifo_refeed(struct fifo *f, uint64_t pos, int fd)
+{
+	struct iovec iov[2];
+	int cnt = (int)(f->end - pos);
+
+	if(cnt <= 0 || (!f->proc && !f->filters)) {
+		return cnt > 0 ? cnt : 0;
 	}
 
+	fifo_span_iov(f, pos, cnt, iov);
+	f->end = pos;
+	cnt = fifo_filter_iov(f, iov, cnt, fd);
+	log_info("Refed %d into %d, count is now %d.", cnt, fd, fifo_count(f));
+
 	return cnt;
 }
 
 
-/** Attempt to empty the fifo by calling write().
+/** Fills iov with the data in the fifo.  The first span is the oldest.
+ *  The spans point into the fifo so they're only valid until the
+ *  fifo is next modified.
+ *
+ *  @returns the number of spans used (0 if the fifo is empty, 2 if
+ *  the data wraps).  A mirrored fifo always returns 0 or 1.
+ */
+
+int fifo_iov(struct fifo *f, struct iovec *iov)
+{
+	return fifo_span_iov(f, f->beg, fifo_count(f), iov);
+}
+
+
+/** Attempt to empty the fifo by calling writev().
+ *
+ *  If the data wraps, both pieces are handed to a single writev so
+ *  it still only takes one syscall.
  *  
  * @returns the number of bytes written or -1 if there was an error.
  * This routine should never return 0 but I can't guarantee it.
@@ -294,33 +776,22 @@ int fifo_read(struct fifo *f, int fd)
 
 int fifo_write(struct fifo *f, int fd)
 {
-	int cnt = 0;
-	int n;
+	struct iovec iov[2];
+	int cnt, n;
 
-	if(f->beg < f->end) {
-		do {
-			errno = 0;
-			cnt = write(fd, f->buf+f->beg, f->end-f->beg);
-			logwr(fd, f->buf+f->beg, f->end-f->beg, cnt);
-		} while(cnt == -1 && errno == EINTR);
-		if(cnt > 0) f->beg += cnt;
-	} else if(f->beg > f->end) {
-		do {
-			errno = 0;
-			cnt = write(fd, f->buf+f->beg, f->size-f->beg);
-			logwr(fd, f->buf+f->beg, f->size-f->beg, cnt);
-		} while(cnt == -1 && errno == EINTR);
-		if(cnt > 0) {
-			f->beg = (f->beg + cnt) % f->size;
-			if(f->beg == 0) {
-				do {
-					errno = 0;
-					n = write(fd, f->buf, f->end);
-					logwr(fd, f->buf, f->end, n);
-				} while(n == -1 && errno == EINTR);
-				if(n > 0) { f->beg = n; cnt += n; }
-			}
-		}
+	n = fifo_iov(f, iov);
+	if(n == 0) {
+		return 0;
+	}
+
+	do {
+		errno = 0;
+		cnt = io_writev(fd, iov, n);
+		logwr(fd, iov[0].iov_base, iov[0].iov_len, cnt);
+	} while(cnt == -1 && errno == EINTR);
+
+	if(cnt > 0) {
+		f->beg += cnt;
 	}
 
 	return cnt;
@@ -332,19 +803,19 @@ int fifo_write(struct fifo *f, int fd)
 
 int fifo_copy(struct fifo *src, struct fifo *dst)
 {
-	int cnt = fifo_count(src);
+	struct iovec iov[2];
 	int ava = fifo_avail(dst);
-	if(ava < cnt) cnt = ava;
-
-	if(src->beg + cnt > src->size) {
-		int n = src->size - src->beg;
-		fifo_unsafe_append(dst, src->buf+src->beg, n);
-		fifo_unsafe_append(dst, src->buf, cnt - n);
-	} else {
-		fifo_unsafe_append(dst, src->buf+src->beg, cnt);
+	int cnt = 0;
+	int i, n, len;
+
+	n = fifo_iov(src, iov);
+	for(i=0; i<n && cnt < ava; i++) {
+		len = iov[i].iov_len;
+		if(len > ava - cnt) len = ava - cnt;
+		fifo_unsafe_append(dst, iov[i].iov_base, len);
+		cnt += len;
 	}
 
-	src->beg = (src->beg + cnt) % src->size;
+	src->beg += cnt;
 	return cnt;
 }
-
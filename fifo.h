@@ -4,20 +4,68 @@
  *
  * This file is released under the MIT license.  This is basically the
  * same as public domain, but absolves the author of liability.
- *
- * todo: add dynamic resizing.
  */
 
+#include <stdint.h>
+
 struct fifo;
+struct filter;
+struct iovec;
+
+/* A fifo proc filters data as it's read into the fifo.  fifo_read
+ * reads straight into the fifo's free space so buf points into the
+ * fifo itself.  The proc hands down a verdict on each range of buf,
+ * in order:
+ *
+ *   keep:   fifo_unsafe_append() it.  This costs nothing unless
+ *           something ahead of it was dropped: the range is already
+ *           where it belongs.
+ *   drop:   don't append it.
+ *   insert: fifo_unsafe_reserve(), then append data that wasn't in
+ *           buf.  Without the reserve it would clobber the input
+ *           that the proc hasn't looked at yet.
+ *   hold:   keep it on a later call (a partial match, say).  Set
+ *           held to the number of bytes being held.  fifo_read
+ *           leaves that much room in front of the next input so
+ *           inserting them then doesn't move anything.
+ *
+ * A proc that keeps everything never copies a byte.
+ */
 
 typedef void (*fifo_proc)(struct fifo *ff, const char *buf, int size, int fd);
 
+/* A peek proc lets data bypass the fifo (see pipe_splice_read).  It's
+ * handed a copy of the data that's waiting to be read and returns how
+ * many bytes at the start of it the fifo proc would pass through
+ * untouched and without changing its state.  Those bytes are never
+ * shown to the fifo proc.
+ */
+
+typedef int (*fifo_peek_proc)(struct fifo *ff, const char *buf, int size);
+
+/* beg and end are absolute positions in the stream of data passing
+ * through the fifo: end counts every byte ever put into the fifo and
+ * beg counts every byte taken out.  They never wrap (well, not for
+ * 2^64 bytes).  The size is always a power of two so a position is
+ * turned into an index into buf by masking off the high bits.
+ */
+
 struct fifo {
 	char *buf;
-	int beg, end;
+	uint64_t beg, end;
 	int size;
+	int initsize;			// fifo_shrink returns the fifo to this size
+	int maxsize;			// fifo_grow won't grow the fifo past this size
+	int mirrored;			// buf is mapped twice so buf[i] == buf[i+size]
 	fifo_proc proc;
+	fifo_peek_proc peek;	// optional, lets data skip proc (and the fifo)
 	void *refcon;
+	struct filter *filters;	// run before proc, see filter.h
+
+	const char *pendbuf;	// input read by fifo_read but not yet handed to proc
+	int pendcnt;
+	char *scratch;			// holds input moved out of the way by fifo_unsafe_reserve
+	int held;				// bytes the proc is holding on to, not counted as avail
 };
 
 
@@ -28,18 +76,40 @@ struct fifo {
 
 
 #define fifo_empty(f) 		((f)->beg == (f)->end)
+#define fifo_count(f)		((int)((f)->end - (f)->beg))	/* number of bytes of data in the fifo */
+#define fifo_avail(f)		((f)->size - fifo_count(f) - (f)->held)	/* free bytes left in the fifo */
+#define fifo_index(f, pos)	((int)((pos) & ((f)->size - 1)))
+
+/* hands the fifo to a different proc.  Whatever the old one was
+ * holding is its own business so fifo_read stops leaving room for it. */
+#define fifo_set_proc(f, p)	((f)->proc = (p), (f)->held = 0)
+
+/* absolute stream positions of the oldest byte in the fifo (i.e. the
+ * total number of bytes that have been taken out of it) and of the
+ * next byte that will be added (the total number put in). */
+#define fifo_beg_pos(f)		((f)->beg)
+#define fifo_end_pos(f)		((f)->end)
 
 
 /* allocates a fifo initialially able to hold initsize chars
- * and will grow to hold maxsize chars if needed.
+ * and will grow to hold maxsize chars if needed.  Both are rounded
+ * up to a power of two.
+ * If initsize is a multiple of the page size, the fifo is mirrored
+ * so its data and free space are always contiguous (see fifo_iov).
  * Returns NULL if fifo memory couldn't be allocated.
  */
-struct fifo* fifo_init(struct fifo *f, int initsize);
+struct fifo* fifo_init(struct fifo *f, int initsize, int maxsize);
 void fifo_destroy(struct fifo *f);
 
+/* fifos bigger than this many bytes are stored on disk */
+extern int fifo_spill_size;
+
+/* inflate the fifo so it has room for cnt more bytes, returns fifo_avail */
+int fifo_grow(struct fifo *f, int cnt);
+/* deflate an empty fifo back to its initsize */
+void fifo_shrink(struct fifo *f);
+
 void fifo_clear(struct fifo *f);      /* empty the fifo of all data */
-int fifo_count(struct fifo *f);    /* number of bytes of data in the fifo */
-int fifo_avail(struct fifo *f);    /* free bytes left in the fifo */
 
 void fifo_unsafe_addchar(struct fifo *f, char c);
 int fifo_unsafe_getchar(struct fifo *f);
@@ -50,13 +120,23 @@ void fifo_unsafe_append(struct fifo *f, const char *buf, int cnt);
 void fifo_unsafe_prepend(struct fifo *f, const char *buf, int cnt);
 #define fifo_unsafe_prepend_str(f, str) fifo_unsafe_prepend(f, str, strlen(str))
 
+/* make room to add cnt bytes that didn't come from the proc's input */
+void fifo_unsafe_reserve(struct fifo *f, const char **cp, const char **ce, int cnt);
+/* hands data to the fifo's proc, or appends it if there's no proc */
+void fifo_unsafe_feed(struct fifo *f, const char *buf, int size, int fd);
+
 /* grab a memory block out of the fifo */
 void fifo_unsafe_unpend(struct fifo *f, char *buf, int cnt);
 #define fifo_unsafe_unpend_str(f, str) fifo_unsafe_unpend(f, str, strlen(str))
 
-/* fill the fifo by calling read() */
+/* fills iov with the data in the fifo, returns the number of spans (0-2) */
+int fifo_iov(struct fifo *f, struct iovec *iov);
+
+/* fill the fifo by calling readv() straight into its free space */
 int fifo_read(struct fifo *f, int fd);
-/* empty the fifo by calling write() */
+/* run the data from pos on through the proc again, see fifo_read */
+int fifo_refeed(struct fifo *f, uint64_t pos, int fd);
+/* empty the fifo by calling writev() */
 int fifo_write(struct fifo *f, int fd);
 /* copy as much of the data from src as will fit into dst */
 int fifo_copy(struct fifo *src, struct fifo *dst);
@@ -0,0 +1,133 @@
+/* filter.c
+ * Scott Bronson
+ *
+ * A fifo can carry a chain of filters.  Every byte that fifo_read
+ * reads goes through each filter in turn, then through the fifo's
+ * proc (if it has one), and then into the fifo.  The data stays in
+ * the fifo the whole way so a stage that just passes everything along
+ * doesn't copy anything.
+ *
+ * Filters can be installed and removed at any time without disturbing
+ * each other or the fifo's proc, so things like statistics or session
+ * recording can tap a pipe no matter which task currently owns it.
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fifo.h"
+#include "filter.h"
+#include "util.h"
+
+
+void filter_init(struct filter *flt, filter_proc proc, void *refcon)
+{
+	flt->proc = proc;
+	flt->refcon = refcon;
+	flt->next = NULL;
+	flt->fifo = NULL;
+}
+
+
+/** Installs flt on fifo f right after the filter after, or at the
+ *  head of the chain if after is NULL.
+ */
+
+void filter_install(struct fifo *f, struct filter *flt, struct filter *after)
+{
+	assert(flt->fifo == NULL);
+	assert(after == NULL || after->fifo == f);
+
+	flt->fifo = f;
+	if(after) {
+		flt->next = after->next;
+		after->next = flt;
+	} else {
+		flt->next = f->filters;
+		f->filters = flt;
+	}
+}
+
+
+/** Removes flt from whatever fifo it's installed on.  Safe to call
+ *  on a filter that isn't installed.
+ */
+
+void filter_remove(struct filter *flt)
+{
+	struct filter **pp;
+
+	if(flt->fifo == NULL) {
+		return;
+	}
+
+	for(pp=&flt->fifo->filters; *pp; pp=&(*pp)->next) {
+		if(*pp == flt) {
+			*pp = flt->next;
+			break;
+		}
+	}
+
+	flt->next = NULL;
+	flt->fifo = NULL;
+}
+
+
+/** Runs the stages from flt on over buf.  Each stage's output goes
+ *  into the fifo at f->end.  That output is then taken back out and
+ *  handed to the next stage in place, so the fifo only ever holds the
+ *  output of the last stage.
+ */
+
+static void filter_run_from(struct fifo *f, struct filter *flt,
+		const char *buf, int size, int fd)
+{
+	uint64_t pos;
+	char *tmp;
+	int n;
+
+	for(; flt; flt=flt->next) {
+		pos = f->end;
+		(*flt->proc)(flt, buf, size, fd);
+		if(size <= 0) {
+			continue;
+		}
+
+		size = (int)(f->end - pos);
+		f->end = pos;
+		if(size == 0) {
+			return;
+		}
+
+		buf = f->buf + fifo_index(f, pos);
+		n = f->size - fifo_index(f, pos);
+		if(size > n && !f->mirrored) {
+			// The output wrapped around the end of the buffer.  Rare
+			// (only small fifos aren't mirrored) so just straighten
+			// it out in a temporary buffer.
+			tmp = malloc(size);
+			if(tmp == NULL) {
+				perror("allocating filter buffer");
+				bail(62);
+			}
+			memcpy(tmp, buf, n);
+			memcpy(tmp + n, f->buf, size - n);
+			filter_run_from(f, flt->next, tmp, size, fd);
+			free(tmp);
+			return;
+		}
+	}
+
+	fifo_unsafe_feed(f, buf, size, fd);
+}
+
+
+void filter_run(struct fifo *f, const char *buf, int size, int fd)
+{
+	filter_run_from(f, f->filters, buf, size, fd);
+}
@@ -0,0 +1,48 @@
+/* filter.h
+ * Scott Bronson
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+struct fifo;
+struct filter;
+
+/* A filter proc is one stage in a fifo's filter chain.  It's handed
+ * a span of data that fifo_read (or the stage before it) produced and
+ * keeps whatever it wants with filter_pass.  The span lies in the
+ * fifo itself so passing it unchanged costs nothing.  A stage can:
+ *
+ *   pass:   filter_pass the span as is.
+ *   trim:   filter_pass only part of it.
+ *   inject: filter_reserve, then filter_pass data of its own.
+ *   hold:   copy the span somewhere (it will be overwritten) and
+ *           filter_reserve and filter_pass it on a later call.
+ *
+ * Each stage runs over the whole span before the next stage sees what
+ * it passed.  Like fifo procs, a size <= 0 means EOF or error.  Every
+ * stage is told, there's nothing to pass.
+ */
+
+typedef void (*filter_proc)(struct filter *flt, const char *buf, int size, int fd);
+
+struct filter {
+	filter_proc proc;
+	void *refcon;
+	struct filter *next;
+	struct fifo *fifo;		// the fifo this filter is installed on
+};
+
+
+void filter_init(struct filter *flt, filter_proc proc, void *refcon);
+
+/* after==NULL installs the filter at the head of the chain */
+void filter_install(struct fifo *f, struct filter *flt, struct filter *after);
+void filter_remove(struct filter *flt);
+
+/* keep data, or make room to keep data that isn't in the input */
+#define filter_pass(flt, buf, size) fifo_unsafe_append((flt)->fifo, buf, size)
+#define filter_reserve(flt, cp, ce, cnt) fifo_unsafe_reserve((flt)->fifo, cp, ce, cnt)
+
+/* runs data through a fifo's filters, then its proc */
+void filter_run(struct fifo *f, const char *buf, int size, int fd);
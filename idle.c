@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #include "log.h"
+#include "chain.h"
 #include "fifo.h"
 #include "io/io.h"
 #include "pipe.h"
@@ -48,14 +49,14 @@ typedef struct {
 	char xfertime[64];	// elapsed time of transfer
 } idle_numbers;
 
-static void human_bytes(size_t size, char *buf, int bufsiz)
+static void human_bytes(uint64_t size, char *buf, int bufsiz)
 {
-	static const char *suffixes[] = { "B", "kB", "MB", "GB", 0 };
+	static const char *suffixes[] = { "B", "kB", "MB", "GB", "TB", 0 };
 	enum { step = 1024 };
 
 	const char **suffix = &suffixes[0]; 
-	size_t base = 1;
-	size_t num;
+	uint64_t base = 1;
+	uint64_t num;
 	int rem;
 
 	if(size > 0) {
@@ -64,9 +65,9 @@ static void human_bytes(size_t size, char *buf, int bufsiz)
 				num = size / base;
 				rem = (size * 100 / base) % 100;
 				if(base == 1) {
-					snprintf(buf, bufsiz, "%ld %s", (long)num, *suffix);
+					snprintf(buf, bufsiz, "%llu %s", (unsigned long long)num, *suffix);
 				} else {
-					snprintf(buf, bufsiz, "%ld.%02d %s", (long)num, rem, *suffix);
+					snprintf(buf, bufsiz, "%llu.%02d %s", (unsigned long long)num, rem, *suffix);
 				}
 				return;
 			}
@@ -76,7 +77,7 @@ static void human_bytes(size_t size, char *buf, int bufsiz)
 		}
 	}
 
-	snprintf(buf, bufsiz, "%ld B", (long)size);
+	snprintf(buf, bufsiz, "%llu B", (unsigned long long)size);
 }
 
 
@@ -114,7 +115,14 @@ static double timespec_diff(struct timespec *end, struct timespec *start)
 }
 
 
-idle_state* idle_create(master_pipe *mp, const char *command)
+static void idle_proc(io_timer *timer);
+
+/** Starts the display for spec.  It's updated from a timer so it
+ *  keeps going no matter which task is on top or how busy the
+ *  loop is.
+ */
+
+idle_state* idle_create(task_spec *spec, master_pipe *mp, const char *command)
 {
 	idle_state *idle = malloc(sizeof(idle_state));
 	if(idle == NULL) {
@@ -123,18 +131,26 @@ idle_state* idle_create(master_pipe *mp, const char *command)
 	}
 	memset(idle, 0, sizeof(idle_state));
 
+	idle->spec = spec;
 	idle->command = command;
 	idle->send_start_count = mp->input_master.bytes_written;
 	idle->recv_start_count = mp->master_output.bytes_written;
 	idle->call_cnt = 0;
 	clock_gettime(CLOCK_REALTIME, &idle->start_time);
 
+	// the first update happens on the next trip through the loop
+	io_timer_init(&idle->timer, idle_proc);
+	if(!opt_quiet && io_timer_add(&idle->timer, 0) < 0) {
+		log_warn("Could not start the progress display timer");
+	}
+
 	return idle;
 }
 
 
 void idle_destroy(idle_state* idle)
 {
+	io_timer_cancel(&idle->timer);
 	free(idle);
 }
 
@@ -154,13 +170,13 @@ static void idle_get_numbers(task_spec *spec, idle_numbers *out)
 		xfertime = 0.000000001;
 	}
 
-	int sendcnt = spec->master->input_master.bytes_written - idle->send_start_count;
+	uint64_t sendcnt = spec->master->input_master.bytes_written - idle->send_start_count;
 	human_bytes(sendcnt, out->snum, sizeof(out->snum));
-	human_bytes((size_t)((double)sendcnt/xfertime), out->sbps, sizeof(out->sbps));
+	human_bytes((uint64_t)((double)sendcnt/xfertime), out->sbps, sizeof(out->sbps));
 
-	int recvcnt = spec->master->master_output.bytes_written - idle->recv_start_count;
+	uint64_t recvcnt = spec->master->master_output.bytes_written - idle->recv_start_count;
 	human_bytes(recvcnt, out->rnum, sizeof(out->rnum));
-	human_bytes((size_t)((double)recvcnt/xfertime), out->rbps, sizeof(out->rbps));
+	human_bytes((uint64_t)((double)recvcnt/xfertime), out->rbps, sizeof(out->rbps));
 
 	human_time(xfertime, out->xfertime, sizeof(out->xfertime));
 }
@@ -184,49 +200,24 @@ static void pad_with_blanks(char *buf, int width)
 /** Prints a continually updated status string during the transfer.
  */
 
-int idle_proc(task_spec *spec)
+static void idle_proc(io_timer *timer)
 {
 	enum {
-		sleeptime = 300,	// time between invocations in ms.
-		fuzztime = 50,		// if there are less than fuzztime ms until
-			// the idle proc comes due, then we just run the idle proc
-			// now.	 It's early, but the user won't know the difference.
-			// More efficient to do it this way rather than requiring our
-			// own timeout at precisely the right time.
-		// In short:
-		// minimum time to next idleproc: sleeptime - fuzztime.
-		// maximum time to next idleproc: sleeptime.
+		sleeptime = 300,	// time between updates in ms.
 	};
 
+	idle_state *idle = (idle_state*)timer;
+	task_spec *spec = idle->spec;
 	char buf[256];
 	int len;
 	idle_numbers numbers, *n = &numbers;
-	idle_state *idle = (idle_state*)spec->idle_refcon;
-
-	struct timespec now_time;
-	double diff;
-	int bah;
 
-
-	if(opt_quiet) {
-		return sleeptime;
-	}
-
-	// We will get called much more often than our sleeptime when i/o
-	// is heavy.  Ensure that we don't update the display too fast.
-	// The first time we're called, tv_sec will be 0.  After that,
-	// we just need to ensure that we wait for the appropriate amount
-	// of time before updating the display again.
-	if(idle->last_time.tv_sec != 0) {
-		clock_gettime(CLOCK_REALTIME, &now_time);
-		diff = timespec_diff(&now_time, &idle->last_time);
-		bah = sleeptime - (int)(diff*1000);
-		if(bah > fuzztime) {
-			return bah;
-		}
+	// only the topmost task gets to draw
+	if(spec->master == NULL || spec->master->task_head->spec != spec) {
+		io_timer_add(&idle->timer, sleeptime);
+		return;
 	}
 
-
 	log_dbg("updating display");
 
 	idle->call_cnt += 1;
@@ -245,10 +236,9 @@ int idle_proc(task_spec *spec)
 	buf[len-1] = '\r';
 
 	// ok, this list of pointers is a little silly.
-	write(spec->master->task_head->next->spec->outfd, buf, len);
+	io_write(spec->master->task_head->next->spec->outfd, buf, len);
 
-	clock_gettime(CLOCK_REALTIME, &idle->last_time);
-	return sleeptime;
+	io_timer_add(&idle->timer, sleeptime);
 }
 
 
@@ -0,0 +1,453 @@
+// io.c
+// Scott Bronson
+//
+// Forwards the io API to whichever backend was picked at runtime.
+// The backend comes from io_use, or the RZH_IO environment variable,
+// or it's the first in the list below that this platform supports.
+//
+// The backends' waits fill in a ready list that io_dispatch walks,
+// so dispatching costs the number of fds with events, not the number
+// of fds open.  Each entry remembers the generation of its fd.  io_del
+// bumps the generation, so an entry for an atom that was deleted (and
+// maybe replaced by a new atom on the same fd) since the wait is
+// dropped rather than handed to the wrong proc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __APPLE__
+    #include <limits.h>
+#else
+    #include <values.h>
+#endif
+#include "io.h"
+
+#ifndef MAXINT
+    #define MAXINT (1ull << ((8 * sizeof(int)) - 2))
+#endif
+
+
+// in order of preference
+static const struct io_backend *backends[] = {
+#ifdef __linux__
+	&io_epoll_backend,
+#endif
+	&io_poll_backend,
+	&io_select_backend,
+#ifdef __linux__
+	&io_epoll_et_backend,	// opt-in only
+	&io_uring_backend,		// opt-in only
+#endif
+	NULL
+};
+
+static const struct io_backend *backend;
+
+struct ready {
+	io_atom *atom;
+	int fd;
+	unsigned gen;
+	int flags;
+};
+
+static struct ready *ready;		// atoms with events to dispatch
+static int nready, maxready;
+
+static unsigned *gens;			// indexed by fd, bumped by io_del
+static int *wants;				// indexed by fd, the atom's current flags
+static int *slots;				// indexed by fd, its entry in ready or -1
+static int maxfds;				// size of gens, wants and slots
+
+
+static const struct io_backend* find_backend(const char *name)
+{
+	int i;
+
+	for(i=0; backends[i]; i++) {
+		if(strcmp(backends[i]->name, name) == 0) {
+			return backends[i];
+		}
+	}
+
+	return NULL;
+}
+
+
+int io_use(const char *name)
+{
+	const struct io_backend *b = find_backend(name);
+	if(b == NULL) {
+		return -1;
+	}
+
+	backend = b;
+	return 0;
+}
+
+
+const char* io_backend_name()
+{
+	return backend ? backend->name : backends[0]->name;
+}
+
+
+const char* io_backend_names()
+{
+	static char buf[64];
+	int i;
+
+	if(!buf[0]) {
+		for(i=0; backends[i]; i++) {
+			if(i) strncat(buf, ", ", sizeof(buf) - strlen(buf) - 1);
+			strncat(buf, backends[i]->name, sizeof(buf) - strlen(buf) - 1);
+		}
+	}
+
+	return buf;
+}
+
+
+static void clear_tables()
+{
+	ready = NULL;
+	nready = maxready = 0;
+	gens = NULL;
+	wants = slots = NULL;
+	maxfds = 0;
+}
+
+
+static int grow_table(void *tablep, int size, int n)
+{
+	void **table = tablep;
+	void *p = realloc(*table, n * size);
+
+	if(p == NULL) {
+		return -1;
+	}
+
+	*table = p;
+	return 0;
+}
+
+
+/** Makes sure the per-fd tables can hold fd. */
+
+static int grow(int fd)
+{
+	int n = maxfds ? maxfds : 64;
+	int i;
+
+	if(fd < maxfds) {
+		return 0;
+	}
+
+	while(n <= fd) {
+		n *= 2;
+	}
+
+	if(grow_table(&gens, sizeof(*gens), n) < 0 ||
+			grow_table(&wants, sizeof(*wants), n) < 0 ||
+			grow_table(&slots, sizeof(*slots), n) < 0) {
+		return -ENOMEM;
+	}
+
+	for(i=maxfds; i<n; i++) {
+		gens[i] = 0;
+		wants[i] = 0;
+		slots[i] = -1;
+	}
+	maxfds = n;
+
+	return 0;
+}
+
+
+void io_ready_add(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+	struct ready *r;
+
+	if(fd < 0 || fd >= maxfds) {
+		return;
+	}
+
+	// an atom only gets one entry, no matter how its events are reported
+	if(slots[fd] >= 0 && ready[slots[fd]].gen == gens[fd]) {
+		ready[slots[fd]].flags |= flags;
+		return;
+	}
+
+	if(nready >= maxready) {
+		if(grow_table(&ready, sizeof(*ready), maxready ? maxready*2 : 64) < 0) {
+			fprintf(stderr, "io_ready_add: out of memory\n");
+			return;
+		}
+		maxready = maxready ? maxready*2 : 64;
+	}
+
+	slots[fd] = nready;
+	r = &ready[nready++];
+	r->atom = atom;
+	r->fd = fd;
+	r->gen = gens[fd];
+	r->flags = flags;
+}
+
+
+void io_init()
+{
+	const char *env;
+	int err;
+
+	if(backend == NULL) {
+		env = getenv("RZH_IO");
+		if(env && io_use(env) < 0) {
+			fprintf(stderr, "RZH_IO: unknown io backend \"%s\"\n", env);
+		}
+	}
+	if(backend == NULL) {
+		backend = backends[0];
+	}
+
+	clear_tables();
+
+	// If the kernel doesn't support the backend (io_uring is often
+	// missing or disabled) fall back to the default, then select.
+	err = (*backend->init)();
+	while(err < 0 && backend != &io_select_backend) {
+		fprintf(stderr, "Could not start %s (%s), using %s instead\n",
+				backend->name, strerror(-err),
+				backend == backends[0] ? "select" : backends[0]->name);
+		backend = backend == backends[0] ? &io_select_backend : backends[0];
+		err = (*backend->init)();
+	}
+}
+
+
+void io_exit()
+{
+	io_child_exit();
+	io_signal_exit();
+	(*backend->exit)();
+	io_timer_exit();
+	free(ready);
+	free(gens);
+	free(wants);
+	free(slots);
+	clear_tables();
+}
+
+
+int io_exit_check()
+{
+	return (*backend->exit_check)();
+}
+
+
+int io_add(io_atom *atom, int flags)
+{
+	int err;
+
+	if(atom->fd < 0) {
+		return -ERANGE;
+	}
+	if(grow(atom->fd) < 0) {
+		return -ENOMEM;
+	}
+
+	err = (*backend->add)(atom, flags);
+	if(!err) {
+		wants[atom->fd] = flags;
+	}
+
+	return err;
+}
+
+
+int io_set(io_atom *atom, int flags)
+{
+	int err = (*backend->set)(atom, flags);
+	if(!err) {
+		wants[atom->fd] = flags;
+	}
+
+	return err;
+}
+
+
+int io_enable(io_atom *atom, int flags)
+{
+	int err = (*backend->enable)(atom, flags);
+	if(!err) {
+		wants[atom->fd] |= flags;
+	}
+
+	return err;
+}
+
+
+int io_disable(io_atom *atom, int flags)
+{
+	int err = (*backend->disable)(atom, flags);
+	if(!err) {
+		wants[atom->fd] &= ~flags;
+	}
+
+	return err;
+}
+
+
+int io_del(io_atom *atom)
+{
+	int err = (*backend->del)(atom);
+	if(!err) {
+		wants[atom->fd] = 0;
+		gens[atom->fd] += 1;
+	}
+
+	return err;
+}
+
+
+int io_again(io_atom *atom, int flags)
+{
+	// level-triggered backends will report the fd again by themselves
+	if(backend->edge) {
+		io_ready_add(atom, flags);
+	}
+
+	return 0;
+}
+
+
+int io_readv(int fd, const struct iovec *iov, int cnt)
+{
+	if(backend && backend->readv) {
+		return (*backend->readv)(fd, iov, cnt);
+	}
+
+	return readv(fd, iov, cnt);
+}
+
+
+int io_writev(int fd, const struct iovec *iov, int cnt)
+{
+	if(backend && backend->writev) {
+		return (*backend->writev)(fd, iov, cnt);
+	}
+
+	return writev(fd, iov, cnt);
+}
+
+
+int io_read(int fd, void *buf, int cnt)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = cnt;
+	return io_readv(fd, &iov, 1);
+}
+
+
+int io_write(int fd, const void *buf, int cnt)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void*)buf;
+	iov.iov_len = cnt;
+	return io_writev(fd, &iov, 1);
+}
+
+
+int io_direct(int fd)
+{
+	if(backend && backend->direct) {
+		return (*backend->direct)(fd);
+	}
+
+	return 1;
+}
+
+
+int io_wait(unsigned int timeout)
+{
+	int ret;
+
+	int ms = timeout == MAXINT ? -1 : (int)timeout;
+
+	// don't sleep if io_again left something to dispatch
+	if(nready) {
+		ms = 0;
+	}
+
+	if(io_stats_on) {
+		io_stats_wait_begin();
+	}
+	ret = (*backend->wait)(io_timer_timeout(ms));
+	if(io_stats_on) {
+		io_stats_wait_end(nready);
+	}
+	io_timer_update();
+	return ret < 0 ? ret : nready;
+}
+
+
+/** Calls the procs for the atoms that the last io_wait found ready,
+ *  then the procs for any signals that arrived, children that exited
+ *  and timers that have come due.  Procs may add,
+ *  delete and io_again atoms while this is going on.
+ */
+
+void io_dispatch()
+{
+	struct ready r;
+	int i, max = nready;
+	unsigned long long start = 0, t;
+	io_proc proc;
+
+	if(io_stats_on) {
+		start = io_stats_clock();
+	}
+
+	for(i=0; i<max; i++) {
+		r = ready[i];	// (a proc can realloc ready)
+		if(slots[r.fd] == i) {
+			slots[r.fd] = -1;
+		}
+
+		// drop it if the atom was deleted since the wait, and don't
+		// hand out events that an earlier proc disabled
+		if(r.gen != gens[r.fd]) {
+			continue;
+		}
+		r.flags &= wants[r.fd];
+		if(r.flags && io_stats_on) {
+			// (the proc might free the atom)
+			proc = r.atom->proc;
+			t = io_stats_clock();
+			(*proc)(r.atom, r.flags);
+			io_stats_proc(proc, io_stats_clock() - t);
+		} else if(r.flags) {
+			(*r.atom->proc)(r.atom, r.flags);
+		}
+	}
+
+	// keep anything that io_again added for the next trip
+	for(i=max; i<nready; i++) {
+		ready[i-max] = ready[i];
+		slots[ready[i-max].fd] = i - max;
+	}
+	nready -= max;
+
+	io_signal_run();
+	io_child_run();
+	io_timer_run();
+
+	if(io_stats_on) {
+		io_stats_dispatch(io_stats_clock() - start);
+	}
+}
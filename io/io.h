@@ -7,13 +7,16 @@
  * This is the generic Async I/O API.  It can be implemented using
  * select, poll, epoll, kqueue, aio, and /dev/poll (hopefully).
  *
- * TODO: should make it so that we can compile every io method
- * into the code then select the most appropriate one at runtime.
+ * Every backend that builds on this platform is compiled in and one
+ * is picked at runtime (see io_use).  io.c forwards each call to it.
  */
 
 #ifndef IO_H
 #define IO_H
 
+#include <stdio.h>
+#include <sys/uio.h>
+
 /// Flag, tells if we're interested in read events.
 #define IO_READ 0x01
 /// Flag, tells if we're interested in write events.
@@ -88,10 +91,171 @@ int io_disable(io_atom *atom, int flags);	///< Disables the given flag(s) withou
 int io_set(io_atom *atom, int flags);   	///< Sets the io_atom::flags on the given atom to flags.
 int io_del(io_atom *atom);              	///< Removes the atom from the list 
 
-/// Waits for an event, then handles it.  Stops waiting if timeout occurs.
-/// Specify MAXINT for no timeout.  The timeout is specified in ms.
+/** Dispatches flags on the atom again after the next io_wait, whether
+ *  or not the fd reports them.  An edge-triggered backend only reports
+ *  an fd when it becomes ready, so a proc that stops reading before it
+ *  sees EAGAIN (to give other fds a turn) must call this or it won't
+ *  hear about the rest of the data.  The other backends ignore it.
+ */
+int io_again(io_atom *atom, int flags);
+
+/** Reads and writes fds that are being watched.  Procs that use these
+ *  instead of read and write let a completion backend (io_uring) do
+ *  the I/O itself: a read returns data that has already arrived, and
+ *  a write is queued and returns right away.  They return what readv
+ *  and writev would, and they are readv and writev on other backends.
+ */
+int io_readv(int fd, const struct iovec *iov, int cnt);
+int io_writev(int fd, const struct iovec *iov, int cnt);
+int io_read(int fd, void *buf, int cnt);
+int io_write(int fd, const void *buf, int cnt);
+
+/// Returns 0 if the backend might be holding data for fd, so it can't
+/// be read or written any other way (splice, tee, recv...).
+int io_direct(int fd);
+
+struct io_timer;
+
+/**
+ * This routine is called when a timer comes due.  The timer is no
+ * longer pending so the proc can io_timer_add it again to repeat.
+ */
+typedef void (*io_timer_proc)(struct io_timer *timer);
+
+/**
+ * A one-shot timer.  Like an io_atom, it will probably be embedded in
+ * a larger structure.  io_wait won't sleep past the earliest pending
+ * timer and io_dispatch calls the procs of the ones that are due
+ * (after the fd events).
+ */
+typedef struct io_timer {
+	io_timer_proc proc;	///< The function to call when the timer comes due.
+	long long when;		///< When it's due, in io_now() milliseconds.
+	int slot;			///< Private, -1 if the timer isn't pending.
+} io_timer;
+
+#define io_timer_init(tt,pp) ((tt)->proc=(pp),(tt)->slot=-1)
+#define io_timer_pending(tt) ((tt)->slot >= 0)
+
+int io_timer_add(io_timer *timer, int ms);	///< Calls the timer's proc in ms milliseconds, rescheduling it if it's already pending.  Returns 0 or -ENOMEM.
+void io_timer_cancel(io_timer *timer);		///< Stops a pending timer.  Does nothing if it isn't pending.
+long long io_now();		///< Monotonic time in ms, as of the last io_wait that had timers pending.
+
+/**
+ * This routine is called from io_dispatch when a signal has arrived.
+ * Unlike a signal handler, it can do anything it wants.  A signal that
+ * arrives several times before it's dispatched is only reported once.
+ */
+typedef void (*io_signal_proc)(int sig, void *refcon);
+
+int io_signal_add(int sig, io_signal_proc proc, void *refcon);	///< Starts delivering sig through the event loop.  Call after io_init.  Returns 0 or a negative errno.
+void io_signal_del(int sig);	///< Stops delivering sig and puts back its old handling.
+
+/**
+ * This routine is called from io_dispatch once a child has exited and
+ * been reaped.  status is what waitpid returned.
+ */
+typedef void (*io_child_proc)(int pid, int status, void *refcon);
+
+/**
+ * Watches a forked child.  Like an io_timer, it will probably be
+ * embedded in a larger structure.  Only the children that are being
+ * watched are reaped.
+ */
+typedef struct io_child {
+	io_atom atom;		///< Private, watches the child's pidfd (fd is -1 if there isn't one).
+	io_child_proc proc;	///< The function to call when the child exits.
+	void *refcon;
+	int pid;
+	int status;
+	struct io_child **list, *prev, *next;	///< Private, list is NULL if the child isn't being watched.
+} io_child;
+
+#define io_child_init(cc) ((cc)->list=NULL)
+
+int io_child_add(io_child *child, int pid, io_child_proc proc, void *refcon);	///< Calls proc when the child exits.  Call after io_init.  Returns 0 or a negative errno.
+void io_child_del(io_child *child);		///< Stops watching the child.  It won't be reaped.
+
+/**
+ * Instrumentation.  Once io_stats_start has been called, the loop
+ * counts its iterations and events and times its waits and each
+ * io_proc.  io_stats_name gives a proc a readable name in the dump.
+ */
+extern int io_stats_on;
+void io_stats_start();
+void io_stats_name(io_proc proc, const char *name);
+void io_stats_dump(FILE *fp);	///< Writes the counts so far to fp.  Does nothing if the stats weren't started.
+
+/// Waits for an event, then handles it.  Stops waiting if timeout occurs
+/// or a timer comes due.  Specify MAXINT for no timeout (other than the
+/// timers).  The timeout is specified in ms.
 int io_wait(unsigned int timeout);
 void io_dispatch();
 
+
+/** A backend implements the calls above.  wait's timeout is -1 to
+ *  wait forever.  init returns 0 or a negative errno, in which case
+ *  io_init falls back to the default backend.  edge is 1 if the
+ *  backend only reports an fd when it becomes ready (see io_again).
+ *  readv, writev and direct are NULL unless the backend does its own
+ *  reading and writing.
+ *
+ *  Backends don't dispatch.  wait calls io_ready_add for every atom
+ *  that has events and io_dispatch takes it from there.
+ */
+
+struct io_backend {
+	const char *name;
+	int (*init)();
+	void (*exit)();
+	int (*exit_check)();
+	int (*add)(io_atom *atom, int flags);
+	int (*set)(io_atom *atom, int flags);
+	int (*enable)(io_atom *atom, int flags);
+	int (*disable)(io_atom *atom, int flags);
+	int (*del)(io_atom *atom);
+	int (*wait)(int timeout);
+	int edge;
+	int (*readv)(int fd, const struct iovec *iov, int cnt);
+	int (*writev)(int fd, const struct iovec *iov, int cnt);
+	int (*direct)(int fd);
+};
+
+/// Called by a backend's wait to queue events for io_dispatch.
+void io_ready_add(io_atom *atom, int flags);
+
+// used by io.c to drive the timers in io_timer.c
+int io_timer_timeout(int timeout);
+void io_timer_update();
+void io_timer_run();
+void io_timer_exit();
+
+// used by io.c to drive the signals in io_signal.c
+void io_signal_run();
+void io_signal_exit();
+
+// used by io.c to drive the children in io_child.c
+void io_child_run();
+void io_child_exit();
+
+// used by io.c to count things for io_stats.c, only if io_stats_on
+unsigned long long io_stats_clock();
+void io_stats_wait_begin();
+void io_stats_wait_end(int nready);
+void io_stats_proc(io_proc proc, unsigned long long ticks);
+void io_stats_dispatch(unsigned long long ticks);
+
+extern const struct io_backend io_select_backend;
+extern const struct io_backend io_poll_backend;
+extern const struct io_backend io_epoll_backend;
+extern const struct io_backend io_epoll_et_backend;
+extern const struct io_backend io_uring_backend;
+
+/// Picks the backend that io_init will use.  Call before io_init.
+/// Returns 0, or -1 if there's no backend with that name.
+int io_use(const char *name);
+const char* io_backend_name();	///< The backend that's in use (or will be).
+const char* io_backend_names();	///< The names that io_use accepts, for help text.
+
 #endif
 
@@ -0,0 +1,201 @@
+// io_child.c
+// Scott Bronson
+//
+// Tells whoever forked a child when that child exits.
+//
+// On Linux each child gets a pidfd, which becomes readable when the
+// child exits, watched by an ordinary io_atom.  Without pidfds (old
+// kernels, other platforms) the children are kept on a list and each
+// SIGCHLD checks them with waitpid(pid, WNOHANG).  Either way only
+// the children that were registered are ever reaped, so two owners
+// can't steal each other's exit statuses like waitpid(-1) would.
+//
+// The atom proc just reaps the child and puts it on the exited list.
+// io_dispatch calls the procs after all the fd events in the same
+// pass (like signals) so a child's last output is read before anyone
+// hears that it exited.
+
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "io.h"
+
+
+static io_child *watching;		// children that are still running
+static io_child *exited;		// reaped, waiting for io_child_run
+static int use_sigchld;			// 1 if pidfds aren't available
+
+
+static void enlist(io_child **list, io_child *child)
+{
+	child->list = list;
+	child->prev = NULL;
+	child->next = *list;
+	if(*list) {
+		(*list)->prev = child;
+	}
+	*list = child;
+}
+
+
+static void delist(io_child *child)
+{
+	if(child->prev) {
+		child->prev->next = child->next;
+	} else {
+		*child->list = child->next;
+	}
+	if(child->next) {
+		child->next->prev = child->prev;
+	}
+	child->list = NULL;
+}
+
+
+static void close_pidfd(io_child *child)
+{
+	if(child->atom.fd >= 0) {
+		io_del(&child->atom);
+		close(child->atom.fd);
+		child->atom.fd = -1;
+	}
+}
+
+
+/** Reaps the child if it has exited.  Returns 1 if it did. */
+
+static int reap(io_child *child)
+{
+	int ret;
+
+	do {
+		ret = waitpid(child->pid, &child->status, WNOHANG);
+	} while(ret < 0 && errno == EINTR);
+
+	if(ret == 0) {
+		return 0;
+	}
+	if(ret < 0) {
+		// (someone else reaped it, probably because SIGCHLD is ignored)
+		child->status = 0;
+	}
+
+	close_pidfd(child);
+	delist(child);
+	enlist(&exited, child);
+	return 1;
+}
+
+
+static void pidfd_proc(io_atom *atom, int flags)
+{
+	reap((io_child*)atom);
+}
+
+
+static void sigchld_proc(int sig, void *refcon)
+{
+	io_child *child, *next;
+
+	for(child=watching; child; child=next) {
+		next = child->next;
+		reap(child);
+	}
+}
+
+
+static int open_pidfd(int pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+
+int io_child_add(io_child *child, int pid, io_child_proc proc, void *refcon)
+{
+	int fd, err;
+
+	io_child_del(child);
+
+	child->pid = pid;
+	child->proc = proc;
+	child->refcon = refcon;
+	io_atom_init(&child->atom, -1, pidfd_proc);
+
+	if(!use_sigchld) {
+		fd = open_pidfd(pid);
+		if(fd >= 0) {
+			child->atom.fd = fd;
+			io_stats_name(pidfd_proc, "io_child");
+			err = io_add(&child->atom, IO_READ);
+			if(err < 0) {
+				close(fd);
+				child->atom.fd = -1;
+				return err;
+			}
+			enlist(&watching, child);
+			return 0;
+		}
+		if(errno != ENOSYS && errno != EPERM) {
+			return -errno;
+		}
+
+		// no pidfds here, fall back to SIGCHLD from now on
+		err = io_signal_add(SIGCHLD, sigchld_proc, NULL);
+		if(err < 0) {
+			return err;
+		}
+		use_sigchld = 1;
+	}
+
+	enlist(&watching, child);
+	// it may have exited before SIGCHLD was being watched
+	reap(child);
+	return 0;
+}
+
+
+void io_child_del(io_child *child)
+{
+	if(child->list) {
+		close_pidfd(child);
+		delist(child);
+	}
+}
+
+
+void io_child_run()
+{
+	io_child *child;
+
+	while(exited) {
+		child = exited;
+		delist(child);
+		(*child->proc)(child->pid, child->status, child->refcon);
+	}
+}
+
+
+void io_child_exit()
+{
+	while(watching) {
+		io_child_del(watching);
+	}
+	while(exited) {
+		io_child_del(exited);
+	}
+	if(use_sigchld) {
+		io_signal_del(SIGCHLD);
+		use_sigchld = 0;
+	}
+}
@@ -2,78 +2,457 @@
 // Scott Bronson
 //
 // Uses epoll to satisfy gatekeeper's network I/O
+//
+// io_enable and io_disable don't call epoll_ctl.  They note the fd on
+// a change list (like io_kqueue.c's newchange) and io_wait hands each
+// changed fd to the kernel once.  A pipe that blocks and unblocks its
+// reader in the same trip through the loop costs no syscalls at all.
+//
+// The "epoll-et" backend registers fds edge-triggered.  The kernel only
+// reports an fd when it becomes ready so procs must read until EAGAIN
+// or call io_again if they stop early.
+//
+// An fd that isn't interested in anything is taken out of the epoll
+// set entirely.  Otherwise epoll would keep reporting its hangups.
+//
+// epoll refuses regular files (select and poll say they're always
+// ready) so those are kept off to the side and reported ready every
+// time.
+//
+// A forked child shares the parent's epoll set.  If the child removed
+// its atoms from it (as task_fork_prepare does), they'd disappear from
+// the parent too.  So the child drops its epoll fd as soon as it's
+// forked and only updates its own tables after that.
+
 
 #include <stdio.h>
-#include <sys/epoll.h>
-#include <sys/time.h>
-#include <sys/resource.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "io.h"
+
 
+// the most events that one epoll_wait will return
+#define MAXEVENTS 256
 
-// This is not an upper-limit.  How can we get more insight into
-// exactly what this does?  Is it better to guess high or guess low?
-#define MAXFDS 10000
+// bits in state[fd]
+#define UNPOLLABLE 0x01		// epoll refused the fd
+#define CHANGED 0x02		// the fd is on the change list
+#define REARM 0x04			// edge mode: re-register even if the flags match
+
+
+static int epfd = -1;
+static int edge;				// register fds with EPOLLET
+
+static io_atom **connections;	// indexed by fd
+static int *conn_flags;			// indexed by fd, the flags the atom wants
+static int *kern_flags;			// indexed by fd, the flags the kernel has
+static char *state;				// indexed by fd, UNPOLLABLE, CHANGED, REARM
+static int maxconns;			// size of all the tables above
+
+static int *changes;			// fds that need to be handed to the kernel
+static int nchanges;
+static int nunpollable;
+
+static struct epoll_event events[MAXEVENTS];
+
+
+static void epoll_forked()
+{
+	if(epfd >= 0) {
+		close(epfd);
+		epfd = -1;
+	}
+}
 
 
-int epfd;
+static void clear_tables()
+{
+	connections = NULL;
+	conn_flags = kern_flags = NULL;
+	state = NULL;
+	changes = NULL;
+	maxconns = nchanges = nunpollable = 0;
+}
 
 
-void io_init()
+static int start(int et)
 {
-	struct rlimit rl;
+	static int atfork;
 
-	if((epfd = epoll_create(MAXFDS)) < 0) {
-		perror("epoll_create");
-		exit(1);
+	if(!atfork) {
+		pthread_atfork(NULL, NULL, epoll_forked);
+		atfork = 1;
 	}
 
-	if(getrlimit(RLIMIT_NOFILE, &rl) == -1) {
-		perror("getrlimit"); 
-		exit(1);
+	clear_tables();
+	edge = et;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epfd < 0) {
+		return -errno;
 	}
 
-	printf("rlimit maxfds: soft=%ld hard=%ld\n",
-			(long)rl.rlim_cur, (long)rl.rlim_max);
+	return 0;
+}
+
 
-	rl.rlim_cur = rl.rlim_max = num_pipes * 2 + 50;
-	if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
-		perror("setrlimit"); 
-		exit(1);
+static int epoll_init()
+{
+	return start(0);
+}
+
+
+static int epoll_et_init()
+{
+	return start(1);
+}
+
+
+static void epoll_exit()
+{
+	epoll_forked();
+	free(connections);
+	free(conn_flags);
+	free(kern_flags);
+	free(state);
+	free(changes);
+	clear_tables();
+}
+
+
+static int epoll_exit_check()
+{
+	int cnt = 0;
+	int i;
+
+	for(i=0; i<maxconns; i++) {
+		if(connections[i]) {
+			fprintf(stderr, "Leaked atom fd=%d proc=%08lX!\n", i, (long)connections[i]);
+			cnt += 1;
+		}
 	}
+
+	return cnt;
 }
 
 
-void io_exit()
+static int grow_table(void *tablep, int size, int n)
 {
-	close(epfd);
+	void **table = tablep;
+	void *p = realloc(*table, n * size);
+
+	if(p == NULL) {
+		return -1;
+	}
+
+	*table = p;
+	return 0;
 }
 
 
-int io_add()
+/** Makes sure the tables can hold fd. */
+
+static int grow(int fd)
 {
-	int err;
+	int n = maxconns ? maxconns : 64;
+	int i;
 
-	err = epoll_ctl(epfd, EPOLL_CTL_ADD, fd,
-			EPOLLIN | EPOLLOUT | EPOLLPRI | EPOLLERR | EPOLLHUP);
-	if(err < 0) {
-		return err;
+	if(fd < maxconns) {
+		return 0;
 	}
+
+	while(n <= fd) {
+		n *= 2;
+	}
+
+	if(grow_table(&connections, sizeof(*connections), n) < 0 ||
+			grow_table(&conn_flags, sizeof(*conn_flags), n) < 0 ||
+			grow_table(&kern_flags, sizeof(*kern_flags), n) < 0 ||
+			grow_table(&state, sizeof(*state), n) < 0 ||
+			grow_table(&changes, sizeof(*changes), n) < 0) {
+		return -ENOMEM;
+	}
+
+	for(i=maxconns; i<n; i++) {
+		connections[i] = NULL;
+		conn_flags[i] = kern_flags[i] = 0;
+		state[i] = 0;
+	}
+	maxconns = n;
+
+	return 0;
 }
 
 
-void io_set(int fd, int flags)
+/** Tells the kernel that fd now wants conn_flags[fd]. */
+
+static int install(int fd)
 {
-	EPOLL_CTL_MOD
+	struct epoll_event ev;
+	int flags = conn_flags[fd];
+	int op;
+
+	if((state[fd] & UNPOLLABLE) || epfd < 0) {
+		kern_flags[fd] = flags;
+		return 0;
+	}
+
+	if(!flags) {
+		op = EPOLL_CTL_DEL;
+	} else if(!kern_flags[fd]) {
+		op = EPOLL_CTL_ADD;
+	} else {
+		op = EPOLL_CTL_MOD;
+	}
+
+	ev.events = ((flags & IO_READ) ? EPOLLIN : 0) |
+		((flags & IO_WRITE) ? EPOLLOUT : 0) |
+		((flags & IO_EXCEPT) ? EPOLLPRI : 0) |
+		(edge ? EPOLLET : 0);
+	ev.data.fd = fd;
+
+	if(epoll_ctl(epfd, op, fd, &ev) < 0) {
+		if(op == EPOLL_CTL_ADD && errno == EEXIST) {
+			// a closed fd with this number is still in the set
+			// (a dup of it must be open somewhere).  Take it over.
+			if(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+				return -errno;
+			}
+		} else if(op == EPOLL_CTL_MOD && errno == ENOENT) {
+			// the fd was closed and reopened behind our back
+			if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+				return -errno;
+			}
+		} else if(op == EPOLL_CTL_ADD && errno == EPERM) {
+			state[fd] |= UNPOLLABLE;
+			nunpollable += 1;
+		} else if(op != EPOLL_CTL_DEL) {
+			// (closing an fd removes it from the set so DEL can fail)
+			return -errno;
+		}
+	}
+
+	kern_flags[fd] = flags;
+	return 0;
 }
 
 
-int io_del(int fd)
+/** Changes the flags fd wants.  The kernel hears about it in io_wait. */
+
+static void change(int fd, int flags)
 {
-	EPOLL_CTL_DEL
+	if(edge && (flags & ~conn_flags[fd])) {
+		// The fd may have become ready while this flag was off and
+		// that edge is gone.  Re-registering makes the kernel look
+		// again, even if the flag was only off for a moment.
+		state[fd] |= REARM;
+	}
+
+	conn_flags[fd] = flags;
+	if(!(state[fd] & CHANGED)) {
+		state[fd] |= CHANGED;
+		changes[nchanges++] = fd;
+	}
 }
 
 
-void io_wait(int timeout)
+static void apply_changes()
 {
+	int i, fd, err;
+
+	for(i=0; i<nchanges; i++) {
+		fd = changes[i];
+		if(conn_flags[fd] != kern_flags[fd] || (state[fd] & REARM)) {
+			err = install(fd);
+			if(err < 0) {
+				fprintf(stderr, "epoll_ctl fd %d: error %d\n", fd, -err);
+			}
+		}
+		state[fd] &= ~(CHANGED | REARM);
+	}
+
+	nchanges = 0;
 }
 
+
+static int epoll_add(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0) {
+		return -ERANGE;
+	}
+	if(grow(fd) < 0) {
+		return -ENOMEM;
+	}
+	if(connections[fd]) {
+		return -EALREADY;
+	}
+
+	connections[fd] = atom;
+	change(fd, flags);
+
+	return 0;
+}
+
+
+static int epoll_set(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	if(flags != conn_flags[fd]) {
+		change(fd, flags);
+	}
+
+	return 0;
+}
+
+
+static int epoll_enable(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	if(flags & ~conn_flags[fd]) {
+		change(fd, conn_flags[fd] | flags);
+	}
+
+	return 0;
+}
+
+
+static int epoll_disable(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	if(flags & conn_flags[fd]) {
+		change(fd, conn_flags[fd] & ~flags);
+	}
+
+	return 0;
+}
+
+
+/** Unlike the other changes, a delete happens right away: the caller
+ *  is probably about to close the fd, and another atom could open the
+ *  same fd number before the next io_wait.
+ */
+
+static int epoll_del(io_atom *atom)
+{
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	conn_flags[fd] = 0;
+	if(kern_flags[fd]) {
+		install(fd);
+	}
+	if(state[fd] & UNPOLLABLE) {
+		nunpollable -= 1;
+	}
+	state[fd] &= CHANGED;	// (stays on the change list, harmlessly)
+	connections[fd] = NULL;
+
+	return 0;
+}
+
+
+/** Waits for events and queues them for io_dispatch.
+ *
+ * @param timeout The maximum amount of time we should wait in
+ * milliseconds, or -1 to wait forever.
+ *
+ * @returns the number of events or a negative number if there
+ * was an error.
+ */
+
+static int epoll_wait_events(int timeout)
+{
+	int i, fd, ret, flags;
+
+	apply_changes();
+
+	// unpollable fds are always ready
+	for(i=0; nunpollable && i<maxconns; i++) {
+		if((state[i] & UNPOLLABLE) && conn_flags[i]) {
+			io_ready_add(connections[i], IO_READ | IO_WRITE);
+			timeout = 0;
+		}
+	}
+
+	do {
+		ret = epoll_wait(epfd, events, MAXEVENTS, timeout);
+	} while(ret < 0 && errno == EINTR);
+
+	for(i=0; i<ret; i++) {
+		fd = events[i].data.fd;
+		flags = 0;
+		if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) flags |= IO_READ;
+		if(events[i].events & (EPOLLOUT | EPOLLERR)) flags |= IO_WRITE;
+		if(events[i].events & EPOLLPRI) flags |= IO_EXCEPT;
+		if(connections[fd]) {
+			io_ready_add(connections[fd], flags);
+		}
+	}
+
+	return ret;
+}
+
+
+const struct io_backend io_epoll_backend = {
+	"epoll",
+	epoll_init,
+	epoll_exit,
+	epoll_exit_check,
+	epoll_add,
+	epoll_set,
+	epoll_enable,
+	epoll_disable,
+	epoll_del,
+	epoll_wait_events,
+	0,
+};
+
+
+const struct io_backend io_epoll_et_backend = {
+	"epoll-et",
+	epoll_et_init,
+	epoll_exit,
+	epoll_exit_check,
+	epoll_add,
+	epoll_set,
+	epoll_enable,
+	epoll_disable,
+	epoll_del,
+	epoll_wait_events,
+	1,
+};
@@ -2,30 +2,263 @@
 // Scott Bronson
 //
 // Uses poll to satisfy gatekeeper's network I/O
+//
+// The pollfd array is kept packed so poll only looks at the fds that
+// are in use.  An fd that isn't interested in anything is negated so
+// poll skips it (otherwise it would keep reporting hangups).
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include "io.h"
+
+
+static io_atom **connections;	// indexed by fd
+static int *slots;				// indexed by fd, the fd's index in ufds
+static int maxconns;			// size of connections and slots
+
+static struct pollfd *ufds;
+static int nfds;
+
+
+static int poll_init()
+{
+	connections = NULL;
+	slots = NULL;
+	maxconns = 0;
+	ufds = NULL;
+	nfds = 0;
+
+	return 0;
+}
+
+
+static void poll_exit()
+{
+	free(connections);
+	free(slots);
+	free(ufds);
+	poll_init();
+}
+
+
+static int poll_exit_check()
+{
+	int cnt = 0;
+	int i;
+
+	for(i=0; i<maxconns; i++) {
+		if(connections[i]) {
+			fprintf(stderr, "Leaked atom fd=%d proc=%08lX!\n", i, (long)connections[i]);
+			cnt += 1;
+		}
+	}
+
+	return cnt;
+}
+
+
+/** Makes sure the tables can hold fd. */
+
+static int grow(int fd)
+{
+	int n = maxconns ? maxconns : 64;
+	void *c, *s, *u;
+	int i;
+
+	if(fd < maxconns) {
+		return 0;
+	}
+
+	while(n <= fd) {
+		n *= 2;
+	}
+
+	c = realloc(connections, n * sizeof(*connections));
+	if(c) connections = c;
+	s = realloc(slots, n * sizeof(*slots));
+	if(s) slots = s;
+	u = realloc(ufds, n * sizeof(*ufds));
+	if(u) ufds = u;
+	if(!c || !s || !u) {
+		return -ENOMEM;
+	}
+
+	for(i=maxconns; i<n; i++) {
+		connections[i] = NULL;
+	}
+	maxconns = n;
+
+	return 0;
+}
+
+
+static int get_events(int flags)
+{
+	return ((flags & IO_READ) ? POLLIN : 0) |
+		((flags & IO_WRITE) ? POLLOUT : 0) |
+		((flags & IO_EXCEPT) ? POLLPRI : 0);
+}
+
+
+static void install(int fd, int events)
+{
+	struct pollfd *p = &ufds[slots[fd]];
+
+	p->events = events;
+	p->fd = events ? fd : ~fd;
+}
+
+
+static int poll_add(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0) {
+		return -ERANGE;
+	}
+	if(grow(fd) < 0) {
+		return -ENOMEM;
+	}
+	if(connections[fd]) {
+		return -EALREADY;
+	}
+
+	connections[fd] = atom;
+	slots[fd] = nfds++;
+	install(fd, get_events(flags));
+
+	return 0;
+}
+
+
+static int poll_set(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
 
-#include <sys/poll.h>
+	install(fd, get_events(flags));
+
+	return 0;
+}
 
 
-#define MAXFDS 
+static int poll_enable(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
 
-struct pollfd ufds[MAXFDS];
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
 
+	install(fd, ufds[slots[fd]].events | get_events(flags));
+
+	return 0;
+}
 
-void io_init()
+
+static int poll_disable(io_atom *atom, int flags)
 {
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	install(fd, ufds[slots[fd]].events & ~get_events(flags));
+
+	return 0;
 }
 
 
-void io_exit()
+static int poll_del(io_atom *atom)
 {
-	close(epfd);
+	int fd = atom->fd;
+	int slot, last;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	// move the last pollfd into the hole to keep the array packed
+	slot = slots[fd];
+	nfds -= 1;
+	if(slot != nfds) {
+		ufds[slot] = ufds[nfds];
+		last = ufds[slot].fd;
+		slots[last < 0 ? ~last : last] = slot;
+	}
+	connections[fd] = NULL;
+
+	return 0;
 }
 
 
-void io_wait()
+/** Waits for events and queues them for io_dispatch.
+ *
+ * @param timeout The maximum amount of time we should wait in
+ * milliseconds, or -1 to wait forever.
+ *
+ * @returns the number of events to be dispatched or a negative
+ * number if there was an error.
+ */
+
+static int poll_wait(int timeout)
 {
-	int nfds;
+	int i, ret, cnt, flags;
 
-	nfds = epoll_wait(epfd, events, maxevent
+	do {
+		ret = poll(ufds, nfds, timeout);
+	} while(ret < 0 && errno == EINTR);
+
+	// ret is the number of fds with revents so stop once they're found
+	cnt = ret;
+	for(i=0; cnt > 0 && i<nfds; i++) {
+		if(!ufds[i].revents) {
+			continue;
+		}
+		cnt--;
+
+		flags = 0;
+		if(ufds[i].revents & (POLLIN | POLLHUP | POLLERR)) flags |= IO_READ;
+		if(ufds[i].revents & (POLLOUT | POLLERR)) flags |= IO_WRITE;
+		if(ufds[i].revents & POLLPRI) flags |= IO_EXCEPT;
+		if(flags) {
+			io_ready_add(connections[ufds[i].fd], flags);
+		}
+	}
+
+	return ret;
 }
 
+
+const struct io_backend io_poll_backend = {
+	"poll",
+	poll_init,
+	poll_exit,
+	poll_exit_check,
+	poll_add,
+	poll_set,
+	poll_enable,
+	poll_disable,
+	poll_del,
+	poll_wait,
+	0,
+};
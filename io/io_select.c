@@ -14,43 +14,35 @@
 
 #include <stdio.h>
 #include <errno.h>
-#ifdef __APPLE__
-    #include <limits.h>
-#else
-    #include <values.h>
-#endif
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "io.h"
 
-#ifndef MAXINT
-    #define MAXINT (1ull << ((8 * sizeof(int)) - 2))
-#endif
-
 static io_atom* connections[FD_SETSIZE];
 static fd_set fd_read, fd_write, fd_except;
 static fd_set gfd_read, gfd_write, gfd_except;
 static int max_fd;	// the highest-numbered filedescriptor in connections.
 
 
-// Pass the file descriptor that you'll be listening and accepting on.
-
-void io_init()
+static int select_init()
 {
 	FD_ZERO(&fd_read);
 	FD_ZERO(&fd_write);
 	FD_ZERO(&fd_except);
+	max_fd = -1;
+
+	return 0;
 }
 
 
-void io_exit()
+static void select_exit()
 {
 	// nothing to do
 }
 
 
-int io_exit_check()
+static int select_exit_check()
 {
 	int cnt = 0;
 	int i;
@@ -89,7 +81,7 @@ static void install(int fd, int flags)
 }
 
 
-int io_add(io_atom *atom, int flags)
+static int select_add(io_atom *atom, int flags)
 {
 	int fd = atom->fd;
 
@@ -108,7 +100,7 @@ int io_add(io_atom *atom, int flags)
 }
 
 
-int io_set(io_atom *atom, int flags)
+static int select_set(io_atom *atom, int flags)
 {
 	int fd = atom->fd;
 
@@ -125,7 +117,7 @@ int io_set(io_atom *atom, int flags)
 }
 
 
-int io_enable(io_atom *atom, int flags)
+static int select_enable(io_atom *atom, int flags)
 {
 	if(atom->fd < 0 || atom->fd > FD_SETSIZE) {
 		return -ERANGE;
@@ -150,7 +142,7 @@ int io_enable(io_atom *atom, int flags)
 }
 
 
-int io_disable(io_atom *atom, int flags)
+static int select_disable(io_atom *atom, int flags)
 {
 	if(atom->fd < 0 || atom->fd > FD_SETSIZE) {
 		return -ERANGE;
@@ -175,7 +167,7 @@ int io_disable(io_atom *atom, int flags)
 }
 
 
-int io_del(io_atom *atom)
+static int select_del(io_atom *atom)
 {
 	int fd = atom->fd;
 
@@ -197,22 +189,22 @@ int io_del(io_atom *atom)
 }
 
 
-/** Waits for events.  See io_dispatch to dispatch the events.
+/** Waits for events and queues them for io_dispatch.
  * 
  * @param timeout The maximum amount of time we should wait in
- * milliseconds.  MAXINT is special-cased to mean forever.
+ * milliseconds, or -1 to wait forever.
  *
  * @returns the number of events to be dispatched or a negative
  * number if there was an error.
  */
 
-int io_wait(unsigned int timeout)
+static int select_wait(int timeout)
 {
 	struct timeval tv;
 	struct timeval *tvp = &tv;
-	int ret;
+	int i, ret, cnt, flags;
 
-	if(timeout == MAXINT) {
+	if(timeout < 0) {
 		tvp = NULL;
 	} else {
 		tv.tv_sec = timeout / 1000;
@@ -227,33 +219,33 @@ int io_wait(unsigned int timeout)
 		ret = select(1+max_fd, &gfd_read, &gfd_write, &gfd_except, tvp);
 	} while(ret < 0 && errno == EINTR);
 
-	return ret;
-}
-
-
-void io_dispatch()
-{
-	int i, max, flags;
-
-    // Note that max_fd might change in the middle of this loop.
-    // For instance, if an acceptor proc opens a new connection
-    // and calls io_add, max_fd will take on the new value.  Therefore,
-    // we need to loop on the value set at the start of the loop.
-
-	max = max_fd;
-	for(i=0; i <= max; i++) {
+	// select counts every bit it sets so we can stop
+	// looking once we've found them all.
+	cnt = ret;
+	for(i=0; cnt > 0 && i <= max_fd; i++) {
 		flags = 0;
-		if(FD_ISSET(i, &gfd_read)) flags |= IO_READ;
-		if(FD_ISSET(i, &gfd_write)) flags |= IO_WRITE;
-		if(FD_ISSET(i, &gfd_except)) flags |= IO_EXCEPT;
-		if(flags) {
-			if(connections[i]) {
-				(*connections[i]->proc)(connections[i], flags);
-			} else {
-				// what do we do -- event on an unknown connection?
-				fprintf(stderr, "io_dispatch: got an event on an uknown connection %d!?\n", i);
-			}
+		if(FD_ISSET(i, &gfd_read)) { flags |= IO_READ; cnt--; }
+		if(FD_ISSET(i, &gfd_write)) { flags |= IO_WRITE; cnt--; }
+		if(FD_ISSET(i, &gfd_except)) { flags |= IO_EXCEPT; cnt--; }
+		if(flags && connections[i]) {
+			io_ready_add(connections[i], flags);
 		}
 	}
+
+	return ret;
 }
 
+
+const struct io_backend io_select_backend = {
+	"select",
+	select_init,
+	select_exit,
+	select_exit_check,
+	select_add,
+	select_set,
+	select_enable,
+	select_disable,
+	select_del,
+	select_wait,
+	0,
+};
@@ -0,0 +1,289 @@
+// io_signal.c
+// Scott Bronson
+//
+// Delivers signals through the event loop so they can be handled like
+// any other event instead of inside a signal handler.
+//
+// On Linux the signals are blocked and read from a signalfd.  Elsewhere
+// (or if signalfd fails) a tiny handler writes the signal number down a
+// self-pipe.  Either way, a single io_atom watches the fd.  Its proc
+// just notes which signals arrived and io_dispatch calls their procs
+// once all the fd events in the same pass have been handled.  That
+// way a SIGCHLD can't tear down a task before the task's last output
+// has been read.
+//
+// Blocked signals survive fork and exec so a forked child puts the
+// signal mask back the way it found it.  The child also closes its
+// copy of the signalfd right away: the parent shares the same file so
+// any change the child made to its mask would change the parent's.
+// (Like io_epoll.c's epoll fd.)
+
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
+#include "io.h"
+
+
+struct handler {
+	io_signal_proc proc;
+	void *refcon;
+	struct sigaction oldact;	// (self-pipe only) restored by io_signal_del
+};
+
+static struct handler handlers[NSIG];
+static volatile sig_atomic_t pending[NSIG];
+static volatile sig_atomic_t any_pending;
+
+static io_atom sigatom = { NULL, -1 };
+static int pipe_wfd = -1;		// write end of the self-pipe, -1 if signalfd
+static sigset_t watched;		// the signals we have procs for
+static sigset_t oldmask;		// the mask before we blocked anything
+static int forked;				// 1 in a forked child, the fds are closed
+
+
+static void signal_forked()
+{
+	if(sigatom.fd >= 0 && !forked) {
+		sigprocmask(SIG_SETMASK, &oldmask, NULL);
+		close(sigatom.fd);
+		if(pipe_wfd >= 0) {
+			close(pipe_wfd);
+		}
+		forked = 1;
+	}
+}
+
+
+static void signal_handler(int sig)
+{
+	int save = errno;
+	char c = sig;
+
+	write(pipe_wfd, &c, 1);
+	errno = save;
+}
+
+
+static void signal_io_proc(io_atom *atom, int flags)
+{
+#ifdef __linux__
+	struct signalfd_siginfo si[16];
+#endif
+	unsigned char buf[64];
+	int i, cnt;
+
+	for(;;) {
+#ifdef __linux__
+		if(pipe_wfd < 0) {
+			cnt = read(atom->fd, si, sizeof(si));
+			for(i=0; i < cnt / (int)sizeof(si[0]); i++) {
+				if(si[i].ssi_signo < NSIG) {
+					pending[si[i].ssi_signo] = 1;
+					any_pending = 1;
+				}
+			}
+			if(cnt < (int)sizeof(si)) {
+				break;
+			}
+			continue;
+		}
+#endif
+		cnt = read(atom->fd, buf, sizeof(buf));
+		for(i=0; i<cnt; i++) {
+			if(buf[i] < NSIG) {
+				pending[buf[i]] = 1;
+				any_pending = 1;
+			}
+		}
+		if(cnt < (int)sizeof(buf)) {
+			break;
+		}
+	}
+}
+
+
+static int open_pipe()
+{
+	int fds[2];
+
+	if(pipe(fds) < 0) {
+		return -errno;
+	}
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+	pipe_wfd = fds[1];
+	return fds[0];
+}
+
+
+static int start()
+{
+	static int atfork;
+	int fd = -1;
+	int err;
+
+	if(!atfork) {
+		pthread_atfork(NULL, NULL, signal_forked);
+		atfork = 1;
+	}
+
+	sigemptyset(&watched);
+	sigprocmask(SIG_SETMASK, NULL, &oldmask);
+
+#ifdef __linux__
+	fd = signalfd(-1, &watched, SFD_NONBLOCK | SFD_CLOEXEC);
+#endif
+	if(fd < 0) {
+		fd = open_pipe();
+		if(fd < 0) {
+			return fd;
+		}
+	}
+
+	io_atom_init(&sigatom, fd, signal_io_proc);
+	io_stats_name(signal_io_proc, "io_signal");
+	err = io_add(&sigatom, IO_READ);
+	if(err < 0) {
+		io_signal_exit();
+		return err;
+	}
+
+	return 0;
+}
+
+
+int io_signal_add(int sig, io_signal_proc proc, void *refcon)
+{
+	struct sigaction act;
+	int err;
+
+	if(sig <= 0 || sig >= NSIG) {
+		return -EINVAL;
+	}
+	if(sigatom.fd < 0) {
+		err = start();
+		if(err < 0) {
+			return err;
+		}
+	}
+
+	handlers[sig].proc = proc;
+	handlers[sig].refcon = refcon;
+	if(sigismember(&watched, sig)) {
+		return 0;
+	}
+	sigaddset(&watched, sig);
+
+	if(pipe_wfd >= 0) {
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = signal_handler;
+		sigemptyset(&act.sa_mask);
+		act.sa_flags = SA_RESTART;
+		if(sigaction(sig, &act, &handlers[sig].oldact) < 0) {
+			return -errno;
+		}
+		return 0;
+	}
+
+#ifdef __linux__
+	{
+		sigset_t one;
+		sigemptyset(&one);
+		sigaddset(&one, sig);
+		sigprocmask(SIG_BLOCK, &one, NULL);
+		if(signalfd(sigatom.fd, &watched, 0) < 0) {
+			return -errno;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+
+void io_signal_del(int sig)
+{
+	if(sig <= 0 || sig >= NSIG || !sigismember(&watched, sig)) {
+		return;
+	}
+
+	sigdelset(&watched, sig);
+	handlers[sig].proc = NULL;
+	pending[sig] = 0;
+
+	if(pipe_wfd >= 0) {
+		sigaction(sig, &handlers[sig].oldact, NULL);
+		return;
+	}
+	if(forked) {
+		return;
+	}
+
+#ifdef __linux__
+	signalfd(sigatom.fd, &watched, 0);
+	if(!sigismember(&oldmask, sig)) {
+		sigset_t one;
+		sigemptyset(&one);
+		sigaddset(&one, sig);
+		sigprocmask(SIG_UNBLOCK, &one, NULL);
+	}
+#endif
+}
+
+
+void io_signal_run()
+{
+	int sig;
+
+	if(!any_pending) {
+		return;
+	}
+
+	any_pending = 0;
+	for(sig=1; sig<NSIG; sig++) {
+		if(pending[sig]) {
+			pending[sig] = 0;
+			if(handlers[sig].proc) {
+				(*handlers[sig].proc)(sig, handlers[sig].refcon);
+			}
+		}
+	}
+}
+
+
+void io_signal_exit()
+{
+	int sig;
+
+	if(sigatom.fd < 0) {
+		return;
+	}
+
+	for(sig=1; sig<NSIG; sig++) {
+		io_signal_del(sig);
+	}
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+	io_del(&sigatom);
+	if(!forked) {
+		close(sigatom.fd);
+		if(pipe_wfd >= 0) {
+			close(pipe_wfd);
+		}
+	}
+	sigatom.fd = -1;
+	pipe_wfd = -1;
+	forked = 0;
+}
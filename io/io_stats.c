@@ -0,0 +1,216 @@
+// io_stats.c
+// Scott Bronson
+//
+// Counters that show where the event loop spends its time: how long
+// it sleeps in the backend's wait, how long it's awake, how many
+// events each wakeup brings, and how many calls and how much time
+// each io_proc gets.
+//
+// Nothing is counted until io_stats_start is called.  After that the
+// cost is a couple of cycle counter reads per wait and per proc call.
+// On x86 the counter is the TSC.  Its rate is worked out when the
+// stats are dumped by comparing it against the monotonic clock.
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "io.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+// the number of procs we keep track of, a power of 2
+#define MAXPROCS 64
+// events per wakeup are counted in log2 buckets: 0, 1, 2-3, 4-7, ...
+#define NBUCKETS 10
+
+
+struct proc_stats {
+	io_proc proc;
+	const char *name;
+	unsigned long long calls;
+	unsigned long long ticks;
+};
+
+int io_stats_on;
+
+static struct proc_stats procs[MAXPROCS];
+
+static unsigned long long start_ticks;
+static long long start_ns;
+static unsigned long long wait_start;	// when the current wait began
+static unsigned long long wake;			// when the last wait returned, 0 if it hasn't
+
+static unsigned long long iterations;
+static unsigned long long wait_ticks;
+static unsigned long long awake_ticks, awake_max;
+static unsigned long long dispatch_ticks;
+static unsigned long long events;
+static unsigned long long buckets[NBUCKETS];
+
+
+static long long mono_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+unsigned long long io_stats_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return mono_ns();
+#endif
+}
+
+
+static struct proc_stats* find(io_proc proc)
+{
+	unsigned int i = ((unsigned long)proc >> 4) & (MAXPROCS-1);
+	int n;
+
+	for(n=0; n<MAXPROCS; n++) {
+		if(procs[i].proc == proc || procs[i].proc == NULL) {
+			procs[i].proc = proc;
+			return &procs[i];
+		}
+		i = (i + 1) & (MAXPROCS-1);
+	}
+
+	return NULL;	// full
+}
+
+
+void io_stats_start()
+{
+	int i;
+
+	// (names registered earlier are kept)
+	for(i=0; i<MAXPROCS; i++) {
+		procs[i].calls = procs[i].ticks = 0;
+	}
+	iterations = wait_ticks = awake_ticks = awake_max = 0;
+	dispatch_ticks = events = 0;
+	memset(buckets, 0, sizeof(buckets));
+	wake = 0;
+
+	start_ns = mono_ns();
+	start_ticks = io_stats_clock();
+	io_stats_on = 1;
+}
+
+
+void io_stats_name(io_proc proc, const char *name)
+{
+	struct proc_stats *ps = find(proc);
+
+	if(ps) {
+		ps->name = name;
+	}
+}
+
+
+void io_stats_wait_begin()
+{
+	wait_start = io_stats_clock();
+	if(wake) {
+		awake_ticks += wait_start - wake;
+		if(wait_start - wake > awake_max) {
+			awake_max = wait_start - wake;
+		}
+	}
+}
+
+
+void io_stats_wait_end(int nready)
+{
+	int b = 0;
+
+	wake = io_stats_clock();
+	wait_ticks += wake - wait_start;
+	iterations += 1;
+
+	events += nready;
+	while(nready > 0 && b < NBUCKETS-1) {
+		nready >>= 1;
+		b += 1;
+	}
+	buckets[b] += 1;
+}
+
+
+void io_stats_proc(io_proc proc, unsigned long long ticks)
+{
+	struct proc_stats *ps = find(proc);
+
+	if(ps) {
+		ps->calls += 1;
+		ps->ticks += ticks;
+	}
+}
+
+
+void io_stats_dispatch(unsigned long long ticks)
+{
+	dispatch_ticks += ticks;
+}
+
+
+/** Writes everything that has been counted so far to fp. */
+
+void io_stats_dump(FILE *fp)
+{
+	unsigned long long ticks = io_stats_clock() - start_ticks;
+	long long ns = mono_ns() - start_ns;
+	double us;		// microseconds per tick
+	int i;
+
+	if(!io_stats_on) {
+		return;
+	}
+
+	us = ticks ? (double)ns / 1000.0 / ticks : 0;
+
+	fprintf(fp, "io stats (%s) after %.3f s:\n", io_backend_name(), ns / 1e9);
+	fprintf(fp, "  iterations %llu, events %llu (%.2f per wakeup)\n",
+			iterations, events, iterations ? (double)events / iterations : 0.0);
+	fprintf(fp, "  waiting %.0f us, awake %.0f us (max %.0f us in one iteration)\n",
+			wait_ticks * us, awake_ticks * us, awake_max * us);
+	fprintf(fp, "  dispatching %.0f us\n", dispatch_ticks * us);
+
+	fprintf(fp, "  events per wakeup:");
+	for(i=0; i<NBUCKETS; i++) {
+		if(buckets[i]) {
+			if(i < 2) {
+				fprintf(fp, " %d:%llu", i, buckets[i]);
+			} else if(i < NBUCKETS-1) {
+				fprintf(fp, " %d-%d:%llu", 1<<(i-1), (1<<i)-1, buckets[i]);
+			} else {
+				fprintf(fp, " %d+:%llu", 1<<(i-1), buckets[i]);
+			}
+		}
+	}
+	fprintf(fp, "\n");
+
+	for(i=0; i<MAXPROCS; i++) {
+		if(procs[i].calls) {
+			if(procs[i].name) {
+				fprintf(fp, "  %-16s", procs[i].name);
+			} else {
+				fprintf(fp, "  %-16p", (void*)procs[i].proc);
+			}
+			fprintf(fp, " %10llu calls %10.0f us %8.2f us/call\n",
+					procs[i].calls, procs[i].ticks * us,
+					procs[i].ticks * us / procs[i].calls);
+		}
+	}
+
+	fflush(fp);
+}
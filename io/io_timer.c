@@ -0,0 +1,193 @@
+// io_timer.c
+// Scott Bronson
+//
+// Timers for the event loop.  Pending timers live in a binary heap
+// ordered by deadline so io_wait can find the next one in O(1) and
+// add/cancel are O(log n).
+//
+// The monotonic clock is only read when there's a reason to: once per
+// io_wait while timers are pending, and when the first timer is added
+// (the cached time could be stale if nothing has needed it for a
+// while).  A busy loop with no timers never looks at the clock.
+
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "io.h"
+
+
+static io_timer **heap;
+static int count, max;
+static long long now;		// ms on the monotonic clock, see io_now
+static int running;			// 1 while io_timer_run is calling procs
+
+
+static void read_clock()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+long long io_now()
+{
+	return now;
+}
+
+
+static void put(int i, io_timer *timer)
+{
+	heap[i] = timer;
+	timer->slot = i;
+}
+
+
+static void sift_up(int i)
+{
+	io_timer *timer = heap[i];
+	int parent;
+
+	while(i > 0) {
+		parent = (i - 1) / 2;
+		if(heap[parent]->when <= timer->when) {
+			break;
+		}
+		put(i, heap[parent]);
+		i = parent;
+	}
+	put(i, timer);
+}
+
+
+static void sift_down(int i)
+{
+	io_timer *timer = heap[i];
+	int child;
+
+	for(;;) {
+		child = 2*i + 1;
+		if(child >= count) {
+			break;
+		}
+		if(child+1 < count && heap[child+1]->when < heap[child]->when) {
+			child += 1;
+		}
+		if(timer->when <= heap[child]->when) {
+			break;
+		}
+		put(i, heap[child]);
+		i = child;
+	}
+	put(i, timer);
+}
+
+
+void io_timer_cancel(io_timer *timer)
+{
+	int i = timer->slot;
+
+	if(i < 0) {
+		return;
+	}
+
+	timer->slot = -1;
+	count -= 1;
+	if(i == count) {
+		return;
+	}
+
+	// fill the hole with the last timer and let it find its level
+	put(i, heap[count]);
+	sift_up(i);
+	sift_down(heap[i]->slot);
+}
+
+
+int io_timer_add(io_timer *timer, int ms)
+{
+	io_timer **p;
+	int n;
+
+	io_timer_cancel(timer);
+
+	if(count == 0) {
+		read_clock();
+	}
+	if(running && ms < 1) {
+		// a proc rescheduling itself shouldn't run again in the same pass
+		ms = 1;
+	}
+
+	if(count >= max) {
+		n = max ? max*2 : 16;
+		p = realloc(heap, n * sizeof(*heap));
+		if(p == NULL) {
+			return -ENOMEM;
+		}
+		heap = p;
+		max = n;
+	}
+
+	timer->when = now + ms;
+	put(count, timer);
+	count += 1;
+	sift_up(timer->slot);
+
+	return 0;
+}
+
+
+int io_timer_timeout(int timeout)
+{
+	long long ms;
+
+	if(count == 0) {
+		return timeout;
+	}
+
+	ms = heap[0]->when - now;
+	if(ms < 0) {
+		ms = 0;
+	}
+	if(timeout < 0 || ms < timeout) {
+		timeout = (int)ms;
+	}
+
+	return timeout;
+}
+
+
+void io_timer_update()
+{
+	if(count) {
+		read_clock();
+	}
+}
+
+
+void io_timer_run()
+{
+	io_timer *timer;
+
+	running = 1;
+	while(count && heap[0]->when <= now) {
+		timer = heap[0];
+		io_timer_cancel(timer);
+		(*timer->proc)(timer);
+	}
+	running = 0;
+}
+
+
+void io_timer_exit()
+{
+	while(count) {
+		io_timer_cancel(heap[0]);
+	}
+	free(heap);
+	heap = NULL;
+	max = 0;
+}
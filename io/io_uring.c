@@ -0,0 +1,1179 @@
+// io_uring.c
+// Scott Bronson
+//
+// Uses io_uring to satisfy gatekeeper's network I/O
+//
+// Talks to the kernel with raw syscalls so liburing isn't needed.
+//
+// An fd starts out polled: it has a one-shot IORING_OP_POLL_ADD
+// outstanding and its proc does its own reads and writes, just like
+// with epoll.  The first time the proc reads or writes the fd through
+// io_readv or io_writev (the fifos and pipes do) that direction of the
+// fd switches over to completions.  It gets a slot, a buffer in a pool
+// that's registered with the kernel, and the kernel reads into and
+// writes out of the slot:
+//
+// - A read slot has a read outstanding whenever its atom wants IO_READ
+//   and the slot is empty.  The atom is dispatched once the read has
+//   completed, and io_readv copies the data out of the slot.
+// - io_writev copies the data into the write slot and returns.  The
+//   slot is written out in the background, and the atom is dispatched
+//   for IO_WRITE whenever the slot has room.
+//
+// These fds are nonblocking and io_uring returns EAGAIN on those
+// rather than waiting, so each read and write is linked behind a
+// POLL_ADD that waits for the fd to become ready.
+//
+// All the polls that need to be (re)armed, the reads and writes, any
+// removals, and the wait itself go to the kernel in a single
+// io_uring_enter per trip through the event loop.  Disabling a flag is
+// lazy: the old poll is left armed and anything it reports for the
+// disabled flag is thrown away.  A read that's already outstanding
+// isn't cancelled either, its data just waits in the slot.
+//
+// Every poll carries the fd and a generation number in its user_data.
+// The generation is bumped whenever a poll is cancelled so late
+// completions from it can be recognized and dropped.  Reads and writes
+// carry their slot, which isn't reused until they've completed.
+//
+// When an atom is deleted, any data left in its read slot is kept for
+// whoever adds the same file next.  Data waiting in its write slot is
+// still written, to a dup of the fd, so deleting and closing an fd
+// doesn't throw away what was written to it.  io_exit gives those
+// writes a moment to finish.
+//
+// A forked child would share the rings with its parent (they're
+// mmapped shared) so the child unmaps them right away.  After that it
+// reads and writes its fds directly and only updates its own tables,
+// like io_epoll.c.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "io.h"
+
+
+// sqes in the submission ring
+#define ENTRIES 256
+
+// the fds that can use completions at once, and their buffers
+#define NSLOTS 64
+#define SLOT_SIZE 16384
+
+// The low two bits of user_data say what the sqe was for.
+#define make_tag(fd, gen) ((unsigned long long)(unsigned)(gen) << 32 | (unsigned)(fd) << 2)
+#define SLOT_TAG(i) ((unsigned long long)(i) << 2 | 1)	// a slot's read or write
+#define LINK_TAG(i) ((unsigned long long)(i) << 2 | 2)	// the poll in front of it
+#define IGNORE_TAG (~0ULL)		// sqes whose completions we don't care about
+
+
+struct slot {
+	int fd;			// -1 if the slot is free
+	int write;		// 1 for a write slot, 0 for a read slot
+	int busy;		// a read or write is outstanding
+	int beg, end;	// the data in buf
+	int eof;		// the last read hit eof
+	int err;		// the errno the last read or write failed with
+	int orphan;		// a write slot whose atom was deleted, fd is our dup
+	dev_t dev;		// a read slot's file, in case its data outlives the atom
+	ino_t ino;
+	char *buf;
+};
+
+
+static int ringfd = -1;
+
+static void *sq_ring, *cq_ring;
+static size_t sq_ring_size, cq_ring_size;
+static struct io_uring_sqe *sqes;
+static size_t sqes_size;
+
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned sq_pending;		// sqes queued but not submitted yet
+
+static struct slot slots[NSLOTS];
+static char *pool;				// the slots' buffers
+static int fixed;				// the pool is registered with the kernel
+static int link_flags;			// for the polls in front of reads and writes
+
+static io_atom **connections;	// indexed by fd
+static int *conn_flags;			// indexed by fd, the flags the atom wants
+static int *armed;				// indexed by fd, the poll events outstanding
+static unsigned *gens;			// indexed by fd, generation of the current poll
+static char *listed;			// indexed by fd, 1 if on the change list
+static int *rslots, *wslots;	// indexed by fd, the fd's slots or -1
+static int maxconns;			// size of all the tables above
+
+static int *changes;			// fds whose polls may need (re)arming
+static int nchanges;
+
+static int reap();
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, ringfd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int sys_register(unsigned opcode, void *arg, unsigned nargs)
+{
+	return syscall(__NR_io_uring_register, ringfd, opcode, arg, nargs);
+}
+
+
+static void unmap_rings()
+{
+	if(sqes) munmap(sqes, sqes_size);
+	if(cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+	if(sq_ring) munmap(sq_ring, sq_ring_size);
+	sqes = NULL;
+	sq_ring = cq_ring = NULL;
+	sq_pending = 0;
+
+	if(ringfd >= 0) {
+		close(ringfd);
+		ringfd = -1;
+	}
+}
+
+
+static void uring_forked()
+{
+	unmap_rings();
+	pool = NULL;	// (MADV_DONTFORK, it isn't there)
+}
+
+
+static void clear_slots()
+{
+	int i;
+
+	for(i=0; i<NSLOTS; i++) {
+		memset(&slots[i], 0, sizeof(slots[i]));
+		slots[i].fd = -1;
+		slots[i].buf = pool ? pool + i*SLOT_SIZE : NULL;
+	}
+}
+
+
+static void clear_tables()
+{
+	connections = NULL;
+	conn_flags = armed = NULL;
+	gens = NULL;
+	listed = NULL;
+	rslots = wslots = NULL;
+	changes = NULL;
+	maxconns = nchanges = 0;
+	sq_pending = 0;
+}
+
+
+/** Sets up the slots' buffers.  They're registered with the kernel if
+ *  it'll let us (it counts them against RLIMIT_MEMLOCK) so it doesn't
+ *  have to map them for every read and write.
+ */
+
+static int pool_init()
+{
+	struct iovec iov;
+
+	pool = mmap(NULL, NSLOTS*SLOT_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(pool == MAP_FAILED) {
+		pool = NULL;
+		return -1;
+	}
+	madvise(pool, NSLOTS*SLOT_SIZE, MADV_DONTFORK);
+
+	iov.iov_base = pool;
+	iov.iov_len = NSLOTS*SLOT_SIZE;
+	fixed = sys_register(IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+
+	clear_slots();
+	return 0;
+}
+
+
+static int uring_init()
+{
+	static int atfork;
+	struct io_uring_params p;
+	int err;
+
+	if(!atfork) {
+		pthread_atfork(NULL, NULL, uring_forked);
+		atfork = 1;
+	}
+
+	clear_tables();
+
+	memset(&p, 0, sizeof(p));
+	ringfd = sys_setup(ENTRIES, &p);
+	if(ringfd < 0) {
+		return -errno;	// ENOSYS on old kernels, EPERM if it's been disabled
+	}
+	fcntl(ringfd, F_SETFD, FD_CLOEXEC);
+
+	sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(cq_ring_size > sq_ring_size) {
+			sq_ring_size = cq_ring_size;
+		}
+		cq_ring_size = sq_ring_size;
+	}
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+	if(sq_ring == MAP_FAILED) {
+		sq_ring = NULL;
+		goto fail;
+	}
+
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ring = sq_ring;
+	} else {
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+		if(cq_ring == MAP_FAILED) {
+			cq_ring = NULL;
+			goto fail;
+		}
+	}
+
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED) {
+		sqes = NULL;
+		goto fail;
+	}
+
+	sq_head = (unsigned*)((char*)sq_ring + p.sq_off.head);
+	sq_tail = (unsigned*)((char*)sq_ring + p.sq_off.tail);
+	sq_mask = (unsigned*)((char*)sq_ring + p.sq_off.ring_mask);
+	sq_array = (unsigned*)((char*)sq_ring + p.sq_off.array);
+	cq_head = (unsigned*)((char*)cq_ring + p.cq_off.head);
+	cq_tail = (unsigned*)((char*)cq_ring + p.cq_off.tail);
+	cq_mask = (unsigned*)((char*)cq_ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)((char*)cq_ring + p.cq_off.cqes);
+
+	if(pool_init() < 0) {
+		goto fail;
+	}
+
+	// a poll that succeeds has nothing to say that the read or
+	// write behind it won't
+	link_flags = IOSQE_IO_LINK;
+#ifdef IORING_FEAT_CQE_SKIP
+	if(p.features & IORING_FEAT_CQE_SKIP) {
+		link_flags |= IOSQE_CQE_SKIP_SUCCESS;
+	}
+#endif
+
+	return 0;
+
+fail:
+	err = -errno;
+	unmap_rings();
+	return err;
+}
+
+
+static int grow_table(void *tablep, int size, int n)
+{
+	void **table = tablep;
+	void *p = realloc(*table, n * size);
+
+	if(p == NULL) {
+		return -1;
+	}
+
+	*table = p;
+	return 0;
+}
+
+
+/** Makes sure the tables can hold fd. */
+
+static int grow(int fd)
+{
+	int n = maxconns ? maxconns : 64;
+	int i;
+
+	if(fd < maxconns) {
+		return 0;
+	}
+
+	while(n <= fd) {
+		n *= 2;
+	}
+
+	if(grow_table(&connections, sizeof(*connections), n) < 0 ||
+			grow_table(&conn_flags, sizeof(*conn_flags), n) < 0 ||
+			grow_table(&armed, sizeof(*armed), n) < 0 ||
+			grow_table(&gens, sizeof(*gens), n) < 0 ||
+			grow_table(&listed, sizeof(*listed), n) < 0 ||
+			grow_table(&rslots, sizeof(*rslots), n) < 0 ||
+			grow_table(&wslots, sizeof(*wslots), n) < 0 ||
+			grow_table(&changes, sizeof(*changes), n) < 0) {
+		return -ENOMEM;
+	}
+
+	for(i=maxconns; i<n; i++) {
+		connections[i] = NULL;
+		conn_flags[i] = armed[i] = 0;
+		gens[i] = 0;
+		listed[i] = 0;
+		rslots[i] = wslots[i] = -1;
+	}
+	maxconns = n;
+
+	return 0;
+}
+
+
+/** Hands the queued sqes to the kernel without waiting. */
+
+static void submit()
+{
+	int ret;
+
+	while(sq_pending) {
+		ret = sys_enter(sq_pending, 0, 0);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+			return;
+		}
+		sq_pending -= ret;
+	}
+}
+
+
+/** Makes sure there's room in the submission ring for n sqes.
+ *  A linked pair mustn't be split across two submissions.
+ */
+
+static void reserve(unsigned n)
+{
+	if(*sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + n > *sq_mask + 1) {
+		submit();
+	}
+}
+
+
+/** Returns a zeroed sqe to fill in, submitting if the ring is full. */
+
+static struct io_uring_sqe* get_sqe()
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	unsigned index;
+
+	reserve(1);
+	tail = *sq_tail;
+	index = tail & *sq_mask;
+	sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	sq_pending += 1;
+
+	return sqe;
+}
+
+
+/** Submits what's queued plus a timeout, then waits for at least one
+ *  completion or the timeout, whichever comes first.  A timeout of 0
+ *  doesn't wait and -1 waits forever.
+ */
+
+static int enter(int timeout)
+{
+	struct __kernel_timespec ts;
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	if(timeout > 0) {
+		// completes after the timeout or the next completion
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		sqe = get_sqe();
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = (unsigned long)&ts;
+		sqe->len = 1;
+		sqe->off = 1;
+		sqe->user_data = IGNORE_TAG;
+	}
+
+	do {
+		ret = sys_enter(sq_pending, timeout ? 1 : 0, IORING_ENTER_GETEVENTS);
+	} while(ret < 0 && errno == EINTR);
+
+	if(ret < 0) {
+		return ret;
+	}
+	sq_pending -= ret < sq_pending ? ret : sq_pending;
+
+	return 0;
+}
+
+
+static void cancel(unsigned long long tag)
+{
+	struct io_uring_sqe *sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = tag;
+	sqe->user_data = IGNORE_TAG;
+}
+
+
+static int same_file(struct slot *s, int fd)
+{
+	struct stat st;
+	return fstat(fd, &st) == 0 && st.st_dev == s->dev && st.st_ino == s->ino;
+}
+
+
+/** Gives fd a read or write slot.  Returns -1 if they're all taken. */
+
+static int slot_alloc(int fd, int write)
+{
+	struct stat st;
+	int i;
+
+	for(i=0; i<NSLOTS; i++) {
+		if(slots[i].fd < 0) {
+			break;
+		}
+	}
+	if(i >= NSLOTS) {
+		return -1;
+	}
+
+	slots[i].fd = fd;
+	slots[i].write = write;
+	if(!write && fstat(fd, &st) == 0) {
+		slots[i].dev = st.st_dev;
+		slots[i].ino = st.st_ino;
+	}
+
+	return i;
+}
+
+
+/** Only call this on a slot that isn't busy. */
+
+static void slot_free(struct slot *s)
+{
+	if(s->orphan && s->fd >= 0) {
+		close(s->fd);
+	}
+
+	s->fd = -1;
+	s->beg = s->end = 0;
+	s->eof = s->err = s->orphan = 0;
+}
+
+
+static int slot_room(struct slot *s)
+{
+	// (the data moves back to the start of buf when the slot isn't busy)
+	return SLOT_SIZE - s->end + (s->busy ? 0 : s->beg);
+}
+
+
+/** Submits slot i's read, or a write of everything in it, behind a
+ *  poll that waits until the fd is ready for it.
+ */
+
+static void slot_start(int i)
+{
+	struct slot *s = &slots[i];
+	struct io_uring_sqe *sqe;
+
+	reserve(2);
+
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = s->fd;
+	sqe->poll_events = s->write ? POLLOUT : POLLIN;
+	sqe->flags = link_flags;
+	sqe->user_data = LINK_TAG(i);
+
+	sqe = get_sqe();
+	sqe->fd = s->fd;
+	sqe->off = -1;	// the file position (pipes and ttys don't have one)
+	if(s->write) {
+		sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->addr = (unsigned long)(s->buf + s->beg);
+		sqe->len = s->end - s->beg;
+	} else {
+		sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->addr = (unsigned long)s->buf;
+		sqe->len = SLOT_SIZE;
+	}
+	sqe->user_data = SLOT_TAG(i);
+
+	s->busy = 1;
+}
+
+
+/** Handles the completion of slot i's read or write. */
+
+static void slot_done(int i, int res)
+{
+	struct slot *s = &slots[i];
+
+	s->busy = 0;
+
+	if(res > 0) {
+		if(s->write) {
+			s->beg += res;
+		} else {
+			s->beg = 0;
+			s->end = res;
+		}
+	} else if(res == 0 && !s->write) {
+		s->eof = 1;
+	} else if(res < 0 && res != -EAGAIN && res != -ECANCELED && res != -EINTR) {
+		// (EAGAIN: somebody else got to the fd first, just try again)
+		s->err = -res;
+	}
+
+	if(s->beg > 0) {
+		memmove(s->buf, s->buf + s->beg, s->end - s->beg);
+		s->end -= s->beg;
+		s->beg = 0;
+	}
+
+	// nobody will ever read an orphan's error
+	if(s->orphan && (s->end == 0 || s->err)) {
+		slot_free(s);
+	}
+}
+
+
+/** Cancels slot i's read or write and waits for it to finish.  It may
+ *  have completed anyway, so check the slot afterward.
+ */
+
+static void slot_settle(int i)
+{
+	cancel(LINK_TAG(i));
+	cancel(SLOT_TAG(i));
+
+	while(slots[i].busy) {
+		if(enter(-1) < 0) {
+			fprintf(stderr, "io_uring_enter: %s\n", strerror(errno));
+			return;
+		}
+		reap();
+	}
+}
+
+
+static void uring_exit_slots()
+{
+	int tries, left, i;
+	struct slot *s;
+
+	// the writes still queued get a couple of seconds to go out
+	for(tries=0; ringfd >= 0 && tries < 200; tries++) {
+		left = 0;
+		for(i=0; i<NSLOTS; i++) {
+			s = &slots[i];
+			if(s->write && s->fd >= 0 && s->end > s->beg && !s->err) {
+				left = 1;
+				if(!s->busy) {
+					slot_start(i);
+				}
+			}
+		}
+		if(!left || enter(10) < 0) {
+			break;
+		}
+		reap();
+	}
+
+	for(i=0; i<NSLOTS; i++) {
+		slot_free(&slots[i]);
+	}
+}
+
+
+static void uring_exit()
+{
+	uring_exit_slots();
+	unmap_rings();	// (this cancels anything that's still outstanding)
+	if(pool) {
+		munmap(pool, NSLOTS*SLOT_SIZE);
+		pool = NULL;
+	}
+
+	free(connections);
+	free(conn_flags);
+	free(armed);
+	free(gens);
+	free(listed);
+	free(rslots);
+	free(wslots);
+	free(changes);
+	clear_tables();
+}
+
+
+static int uring_exit_check()
+{
+	int cnt = 0;
+	int i;
+
+	for(i=0; i<maxconns; i++) {
+		if(connections[i]) {
+			fprintf(stderr, "Leaked atom fd=%d proc=%08lX!\n", i, (long)connections[i]);
+			cnt += 1;
+		}
+	}
+
+	return cnt;
+}
+
+
+/** The poll events that fd needs.  Its reads and writes that use
+ *  slots are started by uring_wait.
+ */
+
+static int poll_mask(int fd)
+{
+	int flags = conn_flags[fd];
+
+	if(rslots[fd] >= 0) flags &= ~IO_READ;
+	if(wslots[fd] >= 0) flags &= ~IO_WRITE;
+
+	return ((flags & IO_READ) ? POLLIN : 0) |
+		((flags & IO_WRITE) ? POLLOUT : 0) |
+		((flags & IO_EXCEPT) ? POLLPRI : 0);
+}
+
+
+/** Cancels fd's outstanding poll.  Its completion will be dropped. */
+
+static void disarm(int fd)
+{
+	struct io_uring_sqe *sqe;
+
+	if(armed[fd] && ringfd >= 0) {
+		sqe = get_sqe();
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = make_tag(fd, gens[fd]);
+		sqe->user_data = IGNORE_TAG;
+	}
+
+	armed[fd] = 0;
+	gens[fd] += 1;
+}
+
+
+/** Makes sure the poll outstanding on fd covers what it wants. */
+
+static void arm(int fd)
+{
+	struct io_uring_sqe *sqe;
+	int want = poll_mask(fd);
+
+	if(!want || (armed[fd] & want) == want) {
+		// nothing to wait for, or the poll already covers it
+		return;
+	}
+
+	if(armed[fd]) {
+		disarm(fd);
+	}
+
+	armed[fd] = want;
+	if(ringfd < 0) {
+		return;
+	}
+
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll_events = want;
+	sqe->user_data = make_tag(fd, gens[fd]);
+}
+
+
+static void change(int fd)
+{
+	if(!listed[fd]) {
+		listed[fd] = 1;
+		changes[nchanges++] = fd;
+	}
+}
+
+
+static int uring_add(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+	int i;
+
+	if(fd < 0) {
+		return -ERANGE;
+	}
+	if(grow(fd) < 0) {
+		return -ENOMEM;
+	}
+	if(connections[fd]) {
+		return -EALREADY;
+	}
+
+	// data left over from an earlier atom only goes to the same file
+	i = rslots[fd];
+	if(i >= 0 && !same_file(&slots[i], fd)) {
+		slot_free(&slots[i]);
+		rslots[fd] = -1;
+	}
+
+	connections[fd] = atom;
+	conn_flags[fd] = flags;
+	change(fd);
+
+	return 0;
+}
+
+
+static int uring_set(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	conn_flags[fd] = flags;
+	change(fd);
+
+	return 0;
+}
+
+
+static int uring_enable(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	if(flags & ~conn_flags[fd]) {
+		conn_flags[fd] |= flags;
+		change(fd);
+	}
+
+	return 0;
+}
+
+
+static int uring_disable(io_atom *atom, int flags)
+{
+	int fd = atom->fd;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	// the poll stays armed, see the top of the file
+	conn_flags[fd] &= ~flags;
+
+	return 0;
+}
+
+
+/** The poll is cancelled right away: an outstanding poll holds a
+ *  reference to the file so it wouldn't really close.  The slots'
+ *  reads and writes are cancelled too.  The kernel looks a linked
+ *  read or write's fd up when its poll fires, by which time the fd
+ *  may have been closed and reused.
+ */
+
+static int uring_del(io_atom *atom)
+{
+	int fd = atom->fd;
+	struct slot *s;
+	int i;
+
+	if(fd < 0 || fd >= maxconns) {
+		return -ERANGE;
+	}
+	if(!connections[fd]) {
+		return -EALREADY;
+	}
+
+	disarm(fd);
+
+	i = rslots[fd];
+	if(i >= 0 && ringfd >= 0) {
+		s = &slots[i];
+		if(s->busy) {
+			slot_settle(i);
+		}
+		if(!s->busy && (s->end == s->beg || !same_file(s, fd))) {
+			slot_free(s);
+			rslots[fd] = -1;
+		}
+	}
+
+	i = wslots[fd];
+	if(i >= 0 && ringfd >= 0) {
+		s = &slots[i];
+		if(s->busy) {
+			slot_settle(i);
+		}
+		if(!s->busy) {
+			if(s->end > s->beg && !s->err) {
+				s->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+				s->orphan = 1;
+			}
+			if(s->fd < 0 || !s->orphan) {
+				slot_free(s);
+			}
+		}
+		wslots[fd] = -1;
+	}
+
+	submit();
+	conn_flags[fd] = 0;
+	connections[fd] = NULL;
+
+	return 0;
+}
+
+
+/** Queues the completed polls for io_dispatch and takes in the
+ *  completed reads and writes.  Returns how many polls completed.
+ */
+
+static int reap()
+{
+	struct io_uring_cqe *cqe;
+	unsigned head = *cq_head;
+	unsigned long long tag;
+	int fd, res, flags;
+	int cnt = 0;
+
+	while(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &cqes[head & *cq_mask];
+		tag = cqe->user_data;
+		res = cqe->res;
+		head++;
+
+		if(tag == IGNORE_TAG) {
+			continue;
+		}
+		if((tag & 3) == 2) {
+			// A linked poll that fails cancels its read or write.
+			// That only reports it if the poll's own success would
+			// have been reported too.
+			if(link_flags != IOSQE_IO_LINK) {
+				slot_done((int)(tag >> 2), res);
+			}
+			continue;
+		}
+		if((tag & 3) == 1) {
+			slot_done((int)(tag >> 2), res);
+			continue;
+		}
+
+		fd = (int)((tag & 0xFFFFFFFF) >> 2);
+		if(fd >= maxconns || (unsigned)(tag >> 32) != gens[fd]) {
+			continue;	// cancelled or superseded
+		}
+
+		// the poll is one-shot so it's done now
+		armed[fd] = 0;
+		if(!connections[fd]) {
+			continue;
+		}
+		change(fd);
+
+		if(res < 0) {
+			// the fd is bad, let the proc find out
+			flags = IO_READ | IO_WRITE;
+		} else {
+			flags = 0;
+			if(res & (POLLIN | POLLHUP | POLLERR)) flags |= IO_READ;
+			if(res & (POLLOUT | POLLERR)) flags |= IO_WRITE;
+			if(res & POLLPRI) flags |= IO_EXCEPT;
+		}
+
+		// a poll from before the fd got its slots
+		if(rslots[fd] >= 0) flags &= ~IO_READ;
+		if(wslots[fd] >= 0) flags &= ~IO_WRITE;
+		if(flags) {
+			io_ready_add(connections[fd], flags);
+			cnt++;
+		}
+	}
+
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+	return cnt;
+}
+
+
+/** Starts the reads and writes that the slots need and queues the
+ *  atoms that can use their slots right now.  Returns how many atoms
+ *  were queued.
+ */
+
+static int run_slots()
+{
+	struct slot *s;
+	int i, fd;
+	int cnt = 0;
+
+	for(i=0; i<NSLOTS; i++) {
+		s = &slots[i];
+		fd = s->fd;
+		if(fd < 0) {
+			continue;
+		}
+
+		if(s->write) {
+			if(!s->busy && s->end > s->beg && !s->err) {
+				slot_start(i);
+			}
+			if(!s->orphan && (conn_flags[fd] & IO_WRITE) && (slot_room(s) || s->err)) {
+				io_ready_add(connections[fd], IO_WRITE);
+				cnt++;
+			}
+		} else if(connections[fd] && (conn_flags[fd] & IO_READ)) {
+			if(s->end > s->beg || s->eof || s->err) {
+				io_ready_add(connections[fd], IO_READ);
+				cnt++;
+			} else if(!s->busy) {
+				slot_start(i);
+			}
+		}
+	}
+
+	return cnt;
+}
+
+
+/** Waits for events and queues them for io_dispatch.
+ *
+ * @param timeout The maximum amount of time we should wait in
+ * milliseconds, or -1 to wait forever.
+ *
+ * @returns the number of fds to be dispatched or a negative
+ * number if there was an error.
+ */
+
+static int uring_wait(int timeout)
+{
+	int i, cnt, ret;
+
+	for(i=0; i<nchanges; i++) {
+		listed[changes[i]] = 0;
+		arm(changes[i]);
+	}
+	nchanges = 0;
+
+	// anything already completed means there's no need to sleep
+	cnt = run_slots();
+	if(cnt || *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		timeout = 0;
+	}
+
+	ret = enter(timeout);
+	if(ret < 0) {
+		return ret;
+	}
+
+	return cnt + reap();
+}
+
+
+/** Copies what's in the read slot into iov.  Once the slot is empty,
+ *  the next io_wait starts another read.  Without a slot (or a ring)
+ *  this is just readv.
+ */
+
+static int uring_readv(int fd, const struct iovec *iov, int cnt)
+{
+	struct slot *s;
+	int i, n, total = 0;
+
+	if(ringfd < 0 || fd < 0 || fd >= maxconns) {
+		return readv(fd, iov, cnt);
+	}
+
+	i = rslots[fd];
+	if(i < 0) {
+		// the fd was ready for this read, the next one is a completion
+		if(connections[fd] && (rslots[fd] = slot_alloc(fd, 0)) >= 0) {
+			change(fd);
+		}
+		return readv(fd, iov, cnt);
+	}
+
+	s = &slots[i];
+	if(s->busy) {
+		// Somebody is reading without being told there's data (a dead
+		// child's pipes are drained this way).  The outstanding read
+		// would come in behind this one.
+		slot_settle(i);
+		if(s->busy) {
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	if(s->end > s->beg) {
+		for(i=0; i<cnt && s->end > s->beg; i++) {
+			n = s->end - s->beg;
+			if(n > iov[i].iov_len) {
+				n = iov[i].iov_len;
+			}
+			memcpy(iov[i].iov_base, s->buf + s->beg, n);
+			s->beg += n;
+			total += n;
+		}
+		if(s->beg == s->end) {
+			s->beg = s->end = 0;
+		}
+		return total;
+	}
+
+	if(s->err) {
+		errno = s->err;
+		s->err = 0;
+		return -1;
+	}
+	if(s->eof) {
+		s->eof = 0;
+		return 0;
+	}
+
+	// nothing outstanding so the fd is safe to read directly
+	return readv(fd, iov, cnt);
+}
+
+
+/** Copies as much of iov as will fit into the write slot.  The next
+ *  io_wait starts writing it out.  Without a slot (or a ring) this is
+ *  just writev.
+ */
+
+static int uring_writev(int fd, const struct iovec *iov, int cnt)
+{
+	struct slot *s;
+	int i, n, total = 0;
+
+	if(ringfd < 0 || fd < 0 || fd >= maxconns) {
+		return writev(fd, iov, cnt);
+	}
+
+	i = wslots[fd];
+	if(i < 0) {
+		if(!connections[fd] || (i = slot_alloc(fd, 1)) < 0) {
+			return writev(fd, iov, cnt);
+		}
+		wslots[fd] = i;
+		change(fd);
+	}
+
+	s = &slots[i];
+	if(s->err) {
+		// (the fd is probably gone, so this error sticks)
+		errno = s->err;
+		return -1;
+	}
+
+	if(!s->busy && s->beg > 0) {
+		memmove(s->buf, s->buf + s->beg, s->end - s->beg);
+		s->end -= s->beg;
+		s->beg = 0;
+	}
+
+	for(i=0; i<cnt && s->end < SLOT_SIZE; i++) {
+		n = SLOT_SIZE - s->end;
+		if(n > iov[i].iov_len) {
+			n = iov[i].iov_len;
+		}
+		memcpy(s->buf + s->end, iov[i].iov_base, n);
+		s->end += n;
+		total += n;
+	}
+
+	if(total == 0 && i < cnt) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return total;
+}
+
+
+/** Returns 0 if one of fd's slots might be holding data for it. */
+
+static int uring_direct(int fd)
+{
+	return ringfd < 0 || fd < 0 || fd >= maxconns ||
+		(rslots[fd] < 0 && wslots[fd] < 0);
+}
+
+
+const struct io_backend io_uring_backend = {
+	"io_uring",
+	uring_init,
+	uring_exit,
+	uring_exit_check,
+	uring_add,
+	uring_set,
+	uring_enable,
+	uring_disable,
+	uring_del,
+	uring_wait,
+	0,
+	uring_readv,
+	uring_writev,
+	uring_direct,
+};
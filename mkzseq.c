@@ -0,0 +1,174 @@
+/* mkzseq.c
+ * Scott Bronson
+ *
+ * Builds the recognizer tables for zseq.c.  The Makefile runs this
+ * and writes its output to zseq_tab.h.
+ *
+ * The patterns go into a trie.  Then each node gets a failure link
+ * to the longest proper suffix of its string that is also in the trie
+ * (Aho-Corasick).  Following the failure links for every node and
+ * byte turns the trie into a DFA: one table lookup per input byte,
+ * and a mismatch in the middle of one pattern lands in the right
+ * spot of any other pattern that might be starting.
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zseq.h"
+
+
+#define MAXSTATES 256
+
+
+static const struct pattern {
+	int id;
+	const char *str;
+} patterns[] = {
+	{ ZSEQ_ZRQINIT, "**\030B00" },
+	{ ZSEQ_ZFIN, "**\030B0800000000022d\r\212" },
+	{ ZSEQ_ABORT, "\030\030\030\030\030" },
+	{ ZSEQ_OO, "OO" },
+	{ ZSEQ_RZ, "rz\r**\030B00" },
+	{ ZSEQ_RZ, "rz\n**\030B00" },
+	{ ZSEQ_RZ, "rz\r\n**\030B00" },
+	{ 0, NULL }
+};
+
+
+static int next[MAXSTATES][256];
+static int fail[MAXSTATES];
+static int depth[MAXSTATES];
+static int term[MAXSTATES];		// the pattern that ends at this node
+static int out[MAXSTATES];		// the patterns that end at this node or its suffixes
+static int reach[MAXSTATES];	// the patterns that this node is a prefix of
+static char str[MAXSTATES][32];
+static int nstates = 1;
+
+
+static void add(const struct pattern *p)
+{
+	const unsigned char *cp = (const unsigned char*)p->str;
+	int s = 0;
+
+	for(; *cp; cp++) {
+		reach[s] |= p->id;
+		if(!next[s][*cp]) {
+			if(nstates >= MAXSTATES) {
+				fprintf(stderr, "mkzseq: too many states\n");
+				exit(1);
+			}
+			depth[nstates] = depth[s] + 1;
+			memcpy(str[nstates], str[s], depth[s]);
+			str[nstates][depth[s]] = *cp;
+			next[s][*cp] = nstates++;
+		}
+		s = next[s][*cp];
+	}
+
+	reach[s] |= p->id;
+	term[s] |= p->id;
+}
+
+
+/** Fills in the failure links breadth first (every node's link is
+ *  shallower than the node itself) and turns missing edges into
+ *  the edges of the failure node.
+ */
+
+static void build()
+{
+	int queue[MAXSTATES];
+	int head = 0, tail = 0;
+	int s, t, c;
+
+	for(c=0; c<256; c++) {
+		if(next[0][c]) {
+			fail[next[0][c]] = 0;
+			queue[tail++] = next[0][c];
+		}
+	}
+
+	while(head < tail) {
+		s = queue[head++];
+		out[s] = term[s] | out[fail[s]];
+		for(c=0; c<256; c++) {
+			t = next[s][c];
+			if(t) {
+				fail[t] = next[fail[s]][c];
+				queue[tail++] = t;
+			} else {
+				next[s][c] = next[fail[s]][c];
+			}
+		}
+	}
+}
+
+
+static void print_str(const char *s, int len)
+{
+	int i;
+
+	putchar('"');
+	for(i=0; i<len; i++) {
+		printf("\\%03o", (unsigned char)s[i]);
+	}
+	putchar('"');
+}
+
+
+static void print_table(const char *type, const char *name, int *table)
+{
+	int s;
+
+	printf("static const %s %s[%d] = {", type, name, nstates);
+	for(s=0; s<nstates; s++) {
+		printf("%s%d,", s % 16 ? " " : "\n\t", table[s]);
+	}
+	printf("\n};\n\n");
+}
+
+
+int main()
+{
+	const struct pattern *p;
+	int s, c;
+
+	for(p=patterns; p->str; p++) {
+		add(p);
+	}
+	build();
+
+	printf("/* zseq_tab.h, generated by mkzseq.c.  Do not edit. */\n\n");
+	printf("#define ZSEQ_NSTATES %d\n\n", nstates);
+
+	printf("static const unsigned char zseq_next[%d][256] = {\n", nstates);
+	for(s=0; s<nstates; s++) {
+		printf("\t{");
+		for(c=0; c<256; c++) {
+			printf("%s%d,", c % 32 ? " " : "\n\t\t", next[s][c]);
+		}
+		printf("\n\t},\n");
+	}
+	printf("};\n\n");
+
+	print_table("unsigned char", "zseq_fail", fail);
+	print_table("unsigned char", "zseq_depths", depth);
+	print_table("unsigned char", "zseq_term", term);
+	print_table("unsigned char", "zseq_out", out);
+	print_table("unsigned char", "zseq_reach", reach);
+
+	printf("static const char *const zseq_strs[%d] = {\n", nstates);
+	for(s=0; s<nstates; s++) {
+		printf("\t");
+		print_str(str[s], depth[s]);
+		printf(",\n");
+	}
+	printf("};\n");
+
+	return 0;
+}
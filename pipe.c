@@ -6,6 +6,7 @@
  */
 
 // TODO: make real error handling
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 
@@ -13,7 +14,11 @@
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
 
+#include "chain.h"
 #include "fifo.h"
 #include "io/io.h"
 #include "log.h"
@@ -21,6 +26,52 @@
 #include "util.h"
 
 
+/** pipe_auto_read stops reading an fd after this many bytes or reads
+ *  and lets the other fds have a turn.
+ */
+
+int pipe_read_budget = 256*1024;
+int pipe_read_count = 32;
+
+
+/** Set to 0 to force all data through the fifo. */
+
+int pipe_splice = 1;
+
+
+/** Pipes with their coalesce flag set don't write as soon as they
+ *  get data.  They go on the dirty list and pipe_flush_dirty writes
+ *  them once per trip through the event loop, so a burst of little
+ *  reads turns into a single write.  Once a pipe is holding
+ *  pipe_coalesce_max bytes it's written right away.
+ *  Set pipe_coalesce to 0 to write everything immediately.
+ */
+
+int pipe_coalesce = 1;
+int pipe_coalesce_max = 16384;
+
+
+/** A pipe stops reading when it's holding pipe_high_water bytes and
+ *  starts again once it has been written down to pipe_low_water.
+ *  0 means use the fifo's maxsize for the high water mark and half
+ *  the high water mark for the low.
+ */
+
+int pipe_high_water = 0;
+int pipe_low_water = 0;
+
+static struct pipe *dirty_head;
+
+#define pipe_coalescing(p) (pipe_coalesce && (p)->coalesce)
+
+
+// the most iovecs we'll hand to a single writev
+#define PIPE_IOV_MAX 16
+
+// the most data that a peek proc is shown at once
+#define PIPE_PEEK_MAX 16384
+
+
 int set_nonblock(int fd)
 {
 	int i;
@@ -58,12 +109,296 @@ static int pipe_fifo_read(struct pipe *pipe)
 }
 
 
+/** Returns S_IFIFO or S_IFSOCK if fd can be handed to splice, 0 if not.
+ *  Ttys (and ptys) can't.
+ */
+
+static int splice_kind(int fd)
+{
+	struct stat st;
+
+	if(fd < 0 || isatty(fd) || fstat(fd, &st) < 0) {
+		return 0;
+	}
+	if(S_ISFIFO(st.st_mode)) {
+		return S_IFIFO;
+	}
+	if(S_ISSOCK(st.st_mode)) {
+		return S_IFSOCK;
+	}
+
+	return 0;
+}
+
+
+/** Figures out whether data can be spliced across this pipe.  splice
+ *  needs a pipe on one side or the other, and the other side can be
+ *  a pipe or a socket.  The answer is remembered until one of the
+ *  pipe's atoms changes fds.
+ */
+
+static int pipe_can_splice(struct pipe *pipe)
+{
+	int rfd, wfd, rk, wk;
+
+	if(!pipe_splice || !pipe->write_atom) {
+		return 0;
+	}
+
+	rfd = pipe->read_atom->atom.fd;
+	wfd = pipe->write_atom->atom.fd;
+
+	// the io backend may be holding data that splice wouldn't see
+	if(!io_direct(rfd) || !io_direct(wfd)) {
+		return 0;
+	}
+
+	if(rfd != pipe->splice_rfd || wfd != pipe->splice_wfd) {
+		pipe->splice_rfd = rfd;
+		pipe->splice_wfd = wfd;
+		rk = splice_kind(rfd);
+		wk = splice_kind(wfd);
+		pipe->splice_ok = rk && wk && (rk == S_IFIFO || wk == S_IFIFO);
+		log_dbg("%s splice from %d to %d", pipe->splice_ok ?
+				"Will" : "Won't", rfd, wfd);
+	}
+
+	return pipe->splice_ok;
+}
+
+
+/** Copies the data waiting on the pipe's read fd into buf without
+ *  consuming it.  Sockets can do this with MSG_PEEK.  Pipes need to
+ *  tee the data into a private pipe and read it back out.
+ *
+ *  @returns the number of bytes copied, 0 if there was nothing to
+ *  copy, or -1 on error.
+ */
+
+static int pipe_peek(struct pipe *pipe, char *buf, int size)
+{
+	int fd = pipe->read_atom->atom.fd;
+	int cnt;
+
+	if(splice_kind(fd) == S_IFSOCK) {
+		cnt = recv(fd, buf, size, MSG_PEEK | MSG_DONTWAIT);
+		return cnt < 0 ? (errno == EAGAIN ? 0 : -1) : cnt;
+	}
+
+	if(pipe->peekfd[0] < 0) {
+		if(pipe2(pipe->peekfd, O_NONBLOCK | O_CLOEXEC) < 0) {
+			log_warn("Could not create peek pipe: %s", strerror(errno));
+			pipe->peekfd[0] = pipe->peekfd[1] = -1;
+			return -1;
+		}
+	}
+
+	cnt = tee(fd, pipe->peekfd[1], size, SPLICE_F_NONBLOCK);
+	if(cnt <= 0) {
+		return cnt < 0 ? (errno == EAGAIN ? 0 : -1) : 0;
+	}
+
+	// The peek pipe is always empty between calls so this gets it all.
+	return read(pipe->peekfd[0], buf, cnt);
+}
+
+
+/** Moves data straight from the read fd to the write fd without
+ *  copying it through the fifo.  Only used while the fifo is empty
+ *  (otherwise the data would go out of order).
+ *
+ *  If the fifo has a proc, the data has to be shown to it first.
+ *  The fifo's peek proc says how much of the data the proc would
+ *  let through untouched and only that much is spliced.  Procs
+ *  without a peek proc see everything so nothing is spliced.
+ *
+ *  @returns the number of bytes moved, or 0 if the caller should
+ *  fall back to reading into the fifo.
+ */
+
+static int pipe_splice_read(struct pipe *pipe, int max)
+{
+	struct fifo *f = &pipe->fifo;
+	static char peekbuf[PIPE_PEEK_MAX];
+	int cnt;
+
+	// filters have to see everything
+	if(pipe_count(pipe) || f->filters || !pipe_can_splice(pipe)) {
+		return 0;
+	}
+
+	if(f->proc) {
+		if(!f->peek) {
+			return 0;
+		}
+		cnt = pipe_peek(pipe, peekbuf, max < PIPE_PEEK_MAX ? max : PIPE_PEEK_MAX);
+		if(cnt <= 0) {
+			return 0;
+		}
+		max = (*f->peek)(f, peekbuf, cnt);
+		if(max <= 0) {
+			return 0;
+		}
+	}
+
+	do {
+		errno = 0;
+		cnt = splice(pipe->read_atom->atom.fd, NULL,
+				pipe->write_atom->atom.fd, NULL, max,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	} while(cnt == -1 && errno == EINTR);
+
+	if(cnt < 0) {
+		if(errno == EINVAL) {
+			// this kernel or this type of fd can't splice after all
+			log_info("Can't splice from %d to %d, copying instead",
+					pipe->read_atom->atom.fd, pipe->write_atom->atom.fd);
+			pipe->splice_ok = 0;
+		}
+		return 0;
+	}
+
+	log_dbg("Spliced %d bytes from %d to %d", cnt,
+			pipe->read_atom->atom.fd, pipe->write_atom->atom.fd);
+	pipe->bytes_written += cnt;
+
+	return cnt;
+}
+
+
+/** Returns the number of bytes waiting to be written. */
+
+int pipe_count(struct pipe *pipe)
+{
+	return chain_count(&pipe->chain) + fifo_count(&pipe->fifo);
+}
+
+
+/** Shortens the iovecs so they hold no more than max bytes.
+ *  Returns how many are left.
+ */
+
+static int iov_trim(struct iovec *iov, int n, uint64_t max)
+{
+	int i;
+
+	for(i=0; i<n; i++) {
+		if(iov[i].iov_len >= max) {
+			iov[i].iov_len = max;
+			return max ? i+1 : i;
+		}
+		max -= iov[i].iov_len;
+	}
+
+	return n;
+}
+
+
+/** Returns the number of bytes in the iovecs. */
+
+static uint64_t iov_total(const struct iovec *iov, int n)
+{
+	uint64_t total = 0;
+	int i;
+
+	for(i=0; i<n; i++) {
+		total += iov[i].iov_len;
+	}
+
+	return total;
+}
+
+
+/** Writes the pipe's chain (if any) and fifo with a single writev.
+ *  If there's a mark, it doesn't write past it.
+ */
+
+static int pipe_chain_write(struct pipe *pipe, int fd)
+{
+	struct iovec iov[PIPE_IOV_MAX];
+	int cnt, n, m;
+
+	n = chain_iov(&pipe->chain, iov, PIPE_IOV_MAX - 2);
+	m = n;
+	if(iov_total(iov, n) == chain_count(&pipe->chain)) {
+		// the whole chain fit so the fifo can go out too
+		m += fifo_iov(&pipe->fifo, iov + n);
+	}
+	if(pipe->mark_proc) {
+		m = iov_trim(iov, m, pipe->mark - pipe->bytes_written);
+	}
+
+	do {
+		errno = 0;
+		cnt = io_writev(fd, iov, m);
+	} while(cnt == -1 && errno == EINTR);
+	log_dbg("Wrote %d bytes from chain and fifo to %d", cnt, fd);
+
+	if(cnt > 0) {
+		n = cnt;
+		if(n > chain_count(&pipe->chain)) {
+			n = chain_count(&pipe->chain);
+		}
+		chain_consume(&pipe->chain, n);
+		pipe->fifo.beg += cnt - n;
+	}
+
+	return cnt;
+}
+
+
+/** Calls the mark proc if everything ahead of the mark has been
+ *  written.  The old writer is finished so it stops listening for
+ *  write events.
+ *
+ *  @returns 1 if the mark proc was called.
+ */
+
+static int pipe_check_mark(struct pipe *pipe)
+{
+	void (*proc)(struct pipe*, void*) = pipe->mark_proc;
+
+	if(!proc || pipe->bytes_written < pipe->mark) {
+		return 0;
+	}
+
+	log_dbg("Wrote up to the mark at %llu, %d bytes follow it",
+			(unsigned long long)pipe->mark, pipe_count(pipe));
+	pipe->mark_proc = NULL;
+	if(pipe->write_atom && pipe->write_atom->atom.fd >= 0) {
+		io_disable(&pipe->write_atom->atom, IO_WRITE);
+	}
+	(*proc)(pipe, pipe->mark_refcon);
+
+	return 1;
+}
+
+
 /** Calls fifo_write and handles the case if it returns EPIPE.
+ *  If that gets the writer to the mark, the mark proc is called and
+ *  whatever follows the mark goes to the new writer.
  */
 
 static int pipe_fifo_write(struct pipe *pipe)
 {
-	int cnt = fifo_write(&pipe->fifo, pipe->write_atom->atom.fd);
+	int cnt, n;
+
+	if(pipe_check_mark(pipe)) {
+		// the mark proc probably changed the writer
+		if(!pipe->write_atom || pipe->write_atom->atom.fd < 0) {
+			return 0;
+		}
+		if(pipe_count(pipe)) {
+			io_enable(&pipe->write_atom->atom, IO_WRITE);
+		}
+	}
+
+	if(chain_empty(&pipe->chain) && !pipe->mark_proc) {
+		cnt = fifo_write(&pipe->fifo, pipe->write_atom->atom.fd);
+	} else {
+		cnt = pipe_chain_write(pipe, pipe->write_atom->atom.fd);
+	}
+
 	if(cnt == -1 && errno == EPIPE) {
 		log_info("Closed FD %d due to EPIPE", pipe->write_atom->atom.fd);
 		close(pipe->write_atom->atom.fd);
@@ -74,45 +409,101 @@ static int pipe_fifo_write(struct pipe *pipe)
 
 	if(cnt > 0) {
 		pipe->bytes_written += cnt;
+		if(pipe->mark_proc && pipe->bytes_written >= pipe->mark) {
+			n = pipe_fifo_write(pipe);
+			return n > 0 ? cnt + n : cnt;
+		}
 	}
 
+	// the writer caught up so let the fifo deflate
+	fifo_shrink(&pipe->fifo);
+
 	return cnt;
 }
 
 
-/** Reads from the input side of the pipe, through the fifo
- * proc, into the fifo.  Immediately writes as much as possible,
- * scheduling any remainer for later.
+/** Reads are blocked until the writer drains the pipe down to the
+ *  low water mark.  Waiting for that, rather than unblocking as soon
+ *  as any room frees up, keeps a saturated pipe from flipping its
+ *  reader on and off with every event.  Call after every write.
  */
 
-static void pipe_auto_read(struct pipe *pipe)
+static void pipe_unblock_read(struct pipe *pipe)
 {
-	int cnt, n;
+	if(pipe->block_read && pipe_count(pipe) <= pipe->low_water &&
+			pipe->read_atom && pipe->read_atom->atom.fd >= 0) {
+		io_enable(&pipe->read_atom->atom, IO_READ);
+		log_dbg("Drained to %d bytes so re-enabling IO_READ on %d",
+				pipe_count(pipe), pipe->read_atom->atom.fd);
+		pipe->block_read = 0;
+	}
+}
 
-#ifndef NDEBUG
-	if(!fifo_avail(&pipe->fifo)) {
-		assert(fifo_avail(&pipe->fifo) > 0);
+
+/** Puts the pipe on the dirty list instead of writing it now.
+ *
+ *  @returns 1 if the write was put off, 0 if the caller should
+ *  write immediately.
+ */
+
+static int pipe_defer(struct pipe *pipe)
+{
+	if(!pipe_coalescing(pipe) || pipe_count(pipe) >= pipe_coalesce_max ||
+			!fifo_avail(&pipe->fifo)) {
+		return 0;
 	}
-#endif
 
-	cnt = pipe_fifo_read(pipe);
-	if(cnt == -1) {
-		log_warn("Error reading %d for pipe: %d (%s)",
-				pipe->read_atom->atom.fd, errno, strerror(errno));
+	if(!pipe->dirty) {
+		pipe->dirty = 1;
+		pipe->next_dirty = dirty_head;
+		dirty_head = pipe;
 	}
 
-	// perhaps the fifo proc sucked up all the data.
-	// Because we're using read/write events, we should never get a
-	// 0-byte read or write (well, the 0-byte read indicates EOF).
-	if(!fifo_count(&pipe->fifo)) {
+	return 1;
+}
+
+
+static void pipe_undirty(struct pipe *pipe)
+{
+	struct pipe **pp;
+
+	if(!pipe->dirty) {
+		return;
+	}
+
+	for(pp=&dirty_head; *pp; pp=&(*pp)->next_dirty) {
+		if(*pp == pipe) {
+			*pp = pipe->next_dirty;
+			break;
+		}
+	}
+
+	pipe->dirty = 0;
+	pipe->next_dirty = NULL;
+}
+
+
+/** Immediately tries to write everything in the pipe.  Anything
+ *  that can't be written is scheduled for later.
+ */
+
+void pipe_flush(struct pipe *pipe)
+{
+	int n;
+
+	pipe_undirty(pipe);
+	if(!pipe->write_atom || pipe->write_atom->atom.fd < 0) {
 		return;
 	}
 
-	// immediately try to write the fifo out
 	pipe_fifo_write(pipe);
 
+	// A coalescing pipe can block its reader and then get drained
+	// here, never arming IO_WRITE, so pipe_auto_write won't restart it.
+	pipe_unblock_read(pipe);
+
 	// return if we're all done (should be the normal case)
-	n = fifo_count(&pipe->fifo);
+	n = pipe_count(pipe);
 	if(!n) {
 		return;
 	}
@@ -122,15 +513,126 @@ static void pipe_auto_read(struct pipe *pipe)
 	io_enable(&pipe->write_atom->atom, IO_WRITE);
 	log_dbg("%d bytes remaining, enabling IO_WRITE on %d",
 			n, pipe->write_atom->atom.fd);
+}
 
-	// if there's no more room in the fifo then we need to stop trying
-	// to read.  We'll restart reading when we manage to write some bytes.
-	if(!fifo_avail(&pipe->fifo)) {
-		log_dbg("fifo is full! Disabling IO_READ on %d",
-				pipe->read_atom->atom.fd);
+
+/** Flushes every pipe on the dirty list.  Call once after each
+ *  io_dispatch.
+ */
+
+void pipe_flush_dirty()
+{
+	while(dirty_head) {
+		pipe_flush(dirty_head);
+	}
+}
+
+
+/** Writes out the data that pipe_auto_read just read (or puts it
+ *  off until pipe_flush_dirty if the pipe is coalescing).
+ *
+ *  @returns 1 if the fifo is full and reading has been blocked.
+ */
+
+static int pipe_read_flush(struct pipe *pipe)
+{
+	if(!pipe_defer(pipe)) {
+		pipe_flush(pipe);
+	}
+
+	// return if we're all done (should be the normal case)
+	if(!pipe_count(pipe)) {
+		return 0;
+	}
+
+	// if there's no more room in the fifo then inflate it so the reader
+	// doesn't have to wait for the writer.  If it can't get any bigger,
+	// or the writer has fallen too far behind, then we need to stop
+	// trying to read.  Reading restarts once a write (pipe_flush or
+	// pipe_auto_write) brings the pipe down to the low water mark.
+	if(!fifo_avail(&pipe->fifo) && fifo_grow(&pipe->fifo, 1) > 0) {
+		log_dbg("fifo is full, inflated it to %d bytes", pipe->fifo.size);
+	}
+	if(!fifo_avail(&pipe->fifo) || pipe_count(pipe) >= pipe->high_water) {
+		log_dbg("%d bytes waiting, high water is %d. Disabling IO_READ on %d",
+				pipe_count(pipe), pipe->high_water, pipe->read_atom->atom.fd);
 		io_disable(&pipe->read_atom->atom, IO_READ);
 		pipe->block_read = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/** Reads from the input side of the pipe, through the fifo
+ * proc, into the fifo.  Immediately writes as much as possible,
+ * scheduling any remainer for later.
+ *
+ * Keeps reading until the fd runs dry so a burst doesn't cost a
+ * trip through io_wait for every fifo-full.  To keep one busy fd
+ * from starving the others, it gives up after pipe_read_budget
+ * bytes or pipe_read_count reads and waits for the next event.
+ */
+
+static void pipe_auto_read(struct pipe *pipe)
+{
+	pipe_atom *atom = pipe->read_atom;
+	int budget = pipe_read_budget;
+	int cnt, i;
+
+	for(i=0; i<pipe_read_count && budget > 0; i++) {
+#ifndef NDEBUG
+		if(!fifo_avail(&pipe->fifo)) {
+			assert(fifo_avail(&pipe->fifo) > 0);
+		}
+#endif
+
+		// Splicing skips the fifo entirely.  If it can't move anything
+		// (EOF, error, full writer...) the fifo read will sort it out.
+		cnt = pipe_splice_read(pipe, budget);
+		if(cnt > 0) {
+			budget -= cnt;
+			continue;
+		}
+
+		cnt = pipe_fifo_read(pipe);
+		if(cnt == -1) {
+			// running out of data is how every burst ends, and a
+			// re-dispatch (io_again) may find the fd already dry.
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				log_warn("Error reading %d for pipe: %d (%s)",
+						atom->atom.fd, errno, strerror(errno));
+			}
+		}
+
+		// perhaps the fifo proc sucked up all the data.
+		// Because we're using read/write events, we should never get a
+		// 0-byte read or write (well, the 0-byte read indicates EOF).
+		if(pipe_count(pipe) && pipe_read_flush(pipe)) {
+			return;
+		}
+
+		// Stop on error or EOF, or if the proc closed the reader out
+		// from under us.
+		if(cnt < 0 || atom->atom.fd < 0) {
+			return;
+		}
+
+		// If the proc switched tasks, there may still be data waiting
+		// for whoever owns the atom now.
+		if(pipe->read_atom != atom) {
+			io_again(&atom->atom, IO_READ);
+			return;
+		}
+
+		budget -= cnt;
 	}
+
+	// The fd probably isn't dry yet.  Edge-triggered backends need
+	// to be told to come back to it.
+	io_again(&atom->atom, IO_READ);
+	log_dbg("Read budget ran out on %d after %d reads", atom->atom.fd, i);
 }
 
 
@@ -149,25 +651,16 @@ static void pipe_auto_write(struct pipe *pipe)
 	// assert(fifo_count(&pipe->fifo) > 0);
 
 	pipe_fifo_write(pipe);
-	
-	// If there's STILL no room in this fifo, it means the operating
-	// system lied to us when it sent us this write notification.
-	// If this assert is giving you trouble, just comment it out.
-	// It indicates an OS bug, not an rzh bug.
-	assert(fifo_avail(&pipe->fifo) > 0);
-
-	// We just freed up some room.  If reads are currently
-	// blocking, we need to unblock them.
-	if(pipe->block_read && pipe->read_atom->atom.fd >= 0) {
-		io_enable(&pipe->read_atom->atom, IO_READ);
-		log_dbg("Freed some room so re-enabling IO_READ on %d",
-				pipe->read_atom->atom.fd);
-		pipe->block_read = 0;
-	}
 
-	// if there's no more data left in the fifo,
+	// The write might not have freed anything up.  The same trip
+	// through the event loop can refill the fifo (in pipe_auto_read)
+	// before we get here with a write notification that's now stale.
+
+	pipe_unblock_read(pipe);
+
+	// if there's no more data left in the pipe,
 	// turn off write notification
-	if(!fifo_count(&pipe->fifo)) {
+	if(!pipe_count(pipe)) {
 		io_disable(&pipe->write_atom->atom, IO_WRITE);
 		log_dbg("Fifo is empty, disabliing IO_WRITE on %d",
 				pipe->write_atom->atom.fd);
@@ -180,9 +673,11 @@ static void pipe_auto_write(struct pipe *pipe)
  *  This is intended to fill pipes programmatically rather than
  *  from a file handle.
  *
+ *  A coalescing pipe doesn't write immediately, it stores everything
+ *  and waits for pipe_flush_dirty.
+ *
  *  @returns The number of bytes written.  This will always equal size
- *  unless the receiving filehandle is blocking AND the fifo is full.
- *  (this should never happen)
+ *  unless the fifo would have to grow past its maxsize.
  */
 
 int pipe_write(struct pipe *pipe, const char *buf, int size)
@@ -190,11 +685,11 @@ int pipe_write(struct pipe *pipe, const char *buf, int size)
 	int cnt;
 	int total = 0;
 
-	if(!fifo_count(&pipe->fifo)) {
+	if(!pipe_count(pipe) && !pipe_coalescing(pipe) && !pipe->mark_proc) {
 		// Nothing in the pipe.  We can try an immediate write.
 		do {
 			errno = 0;
-			cnt = write(pipe->write_atom->atom.fd, buf, size);
+			cnt = io_write(pipe->write_atom->atom.fd, buf, size);
 		} while(cnt == -1 && errno == EINTR);
 		if(cnt < 0) {
 			log_warn("pipe write: cnt=%d error=%d (%s)", cnt, errno, strerror(errno));
@@ -214,14 +709,21 @@ int pipe_write(struct pipe *pipe, const char *buf, int size)
 		return total;
 	}
 
-	// There was unwritten data.  Try to write it to the fifo.
-	cnt = fifo_avail(&pipe->fifo);
+	// There was unwritten data.  Inflate the fifo to hold it.
+	cnt = fifo_grow(&pipe->fifo, size);
 	if(size < cnt) cnt = size;
+	if(cnt < size) {
+		log_warn("pipe write: fifo is full, dropped %d bytes", size - cnt);
+	}
 	fifo_unsafe_append(&pipe->fifo, buf, cnt);
 	buf += cnt;
 	total += cnt;
 	size -= cnt;
 
+	if(pipe_defer(pipe)) {
+		return total;
+	}
+
 	// Need to be notified when we can write again
 	io_enable(&pipe->write_atom->atom, IO_WRITE);
 	log_dbg("Fifo still has data, enabling IO_WRITE on %d",
@@ -231,6 +733,60 @@ int pipe_write(struct pipe *pipe, const char *buf, int size)
 }
 
 
+/** Hands all the data in chain to the pipe, leaving chain empty.
+ *  It's written after anything already in the pipe.  The chain's
+ *  segments are moved, not copied, so this takes the same time no
+ *  matter how much data is in the chain.
+ */
+
+void pipe_write_chain(struct pipe *pipe, struct chain *chain)
+{
+	struct iovec iov[2];
+	int i, n;
+
+	if(chain_empty(chain)) {
+		return;
+	}
+
+	// The pipe writes its chain before its fifo so anything still in
+	// the fifo has to go ahead of the new data.  Only the fifo's
+	// contents get copied.
+	n = fifo_iov(&pipe->fifo, iov);
+	for(i=0; i<n; i++) {
+		chain_append(&pipe->chain, iov[i].iov_base, iov[i].iov_len);
+	}
+	fifo_clear(&pipe->fifo);
+
+	chain_move(&pipe->chain, chain);
+
+	if(!pipe_defer(pipe)) {
+		pipe_flush(pipe);
+	}
+}
+
+
+/** Marks the current end of the pipe's data.  Everything that's
+ *  already in the pipe goes to the current writer.  When it has all
+ *  been written, proc is called.  It usually installs a new writer
+ *  which then receives everything that was added after the mark.
+ *
+ *  This lets a fifo proc hand the stream to a different task at an
+ *  exact spot without waiting for the writer to catch up.  If the
+ *  pipe is already empty, proc is called immediately.
+ */
+
+void pipe_mark(struct pipe *pipe, void (*proc)(struct pipe*, void*), void *refcon)
+{
+	pipe->mark = pipe->bytes_written + pipe_count(pipe);
+	pipe->mark_proc = proc;
+	pipe->mark_refcon = refcon;
+
+	log_dbg("Marked the pipe at %llu with %d bytes before it",
+			(unsigned long long)pipe->mark, pipe_count(pipe));
+	pipe_check_mark(pipe);
+}
+
+
 /** This is the entrypoint for all pipe atom i/o notifications.
  */
 
@@ -283,11 +839,18 @@ void pipe_atom_destroy(pipe_atom *atom)
 /** It's OK for either ratom or watom to be NULL resulting in an unterminated
  *  pipe.  Use this, for instance, when a pipe's data is coming from a procedure
  *  rather than from another pipe.
+ *
+ *  The pipe's fifo starts out holding size bytes and inflates up to
+ *  maxsize bytes when the write side stalls.  The watermarks are set
+ *  from pipe_high_water and pipe_low_water; call pipe_set_watermarks
+ *  to change them.
  */
 
-void pipe_init(struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom, int size)
+void pipe_init(struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom,
+		int size, int maxsize)
 {
-	fifo_init(&pipe->fifo, size);
+	chain_init(&pipe->chain);
+	fifo_init(&pipe->fifo, size, maxsize);
 	if(pipe->fifo.buf == NULL) {
 		perror("could not allocate fifo");
 		bail(99);
@@ -300,6 +863,16 @@ void pipe_init(struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom, int size)
 
 	pipe->block_read = 0;
 	pipe->bytes_written = 0;
+	pipe->splice_rfd = pipe->splice_wfd = -1;
+	pipe->splice_ok = 0;
+	pipe->peekfd[0] = pipe->peekfd[1] = -1;
+	pipe->coalesce = 0;
+	pipe->dirty = 0;
+	pipe->next_dirty = NULL;
+	pipe->mark = 0;
+	pipe->mark_proc = NULL;
+	pipe->mark_refcon = NULL;
+	pipe_set_watermarks(pipe, pipe_low_water, pipe_high_water);
 
 	// all pipes start out listening for readable events
 	// unless there's no atom on the read side (i.e. the progress pipe
@@ -312,10 +885,38 @@ void pipe_init(struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom, int size)
 }
 
 
+/** Sets the points where the pipe stops reading (high) and starts
+ *  again (low).  0 picks the defaults described for pipe_high_water.
+ *  The fifo can't hold more than its maxsize so high is clamped to it.
+ */
+
+void pipe_set_watermarks(struct pipe *pipe, int low, int high)
+{
+	int max = pipe->fifo.maxsize;
+
+	if(high <= 0 || high > max) {
+		high = max;
+	}
+	if(low <= 0 || low >= high) {
+		low = high / 2;
+	}
+
+	pipe->high_water = high;
+	pipe->low_water = low;
+}
+
+
 /** The atoms are destroyed with the tasks, not the pipe. */
 
 void pipe_destroy(struct pipe *pipe)
 {
+	pipe_undirty(pipe);
+	chain_destroy(&pipe->chain);
 	fifo_destroy(&pipe->fifo);
+
+	if(pipe->peekfd[0] >= 0) {
+		close(pipe->peekfd[0]);
+		close(pipe->peekfd[1]);
+	}
 }
 
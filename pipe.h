@@ -13,21 +13,48 @@ typedef struct {
 
 
 struct pipe {
+	struct chain chain;			// data handed to the pipe by pipe_write_chain, written before the fifo
 	struct fifo fifo;			// the fifo itself
 	pipe_atom *read_atom;		// all data read from here ...
 	pipe_atom *write_atom;		// ... gets written to here
 	int block_read;				// 1 if we need to stop reading, 0 if not.
-	int bytes_written;			// a monotonically increasing count of the number of bytes written.
+	int high_water;				// stop reading when this many bytes are waiting...
+	int low_water;				// ... and start again when down to this many.
+	uint64_t bytes_written;		// a monotonically increasing count of the number of bytes written.
+	int splice_rfd, splice_wfd;	// the fds that splice_ok was figured for
+	int splice_ok;				// 1 if data can be spliced from read_atom to write_atom
+	int peekfd[2];				// private pipe used to tee a copy of spliced data for the fifo's peek proc
+	int coalesce;				// 1 if writes should wait for pipe_flush_dirty
+	int dirty;					// 1 if the pipe is on the dirty list
+	struct pipe *next_dirty;	// next pipe on the dirty list
+	uint64_t mark;				// bytes_written when the writer reaches the mark
+	void (*mark_proc)(struct pipe*, void*);	// called once the writer gets to the mark, see pipe_mark
+	void *mark_refcon;
 };
 
 
+extern int pipe_read_budget;
+extern int pipe_read_count;
+extern int pipe_splice;
+extern int pipe_coalesce;
+extern int pipe_coalesce_max;
+extern int pipe_high_water;
+extern int pipe_low_water;
+
 int pipe_prepend(struct pipe *pipe, const char *buf, int size);
 int pipe_write(struct pipe *pipe, const char *buf, int size);
+void pipe_write_chain(struct pipe *pipe, struct chain *chain);
+int pipe_count(struct pipe *pipe);
+void pipe_flush(struct pipe *pipe);
+void pipe_flush_dirty();
+void pipe_mark(struct pipe *pipe, void (*proc)(struct pipe*, void*), void *refcon);
 
 void pipe_atom_init(pipe_atom *atom, int fd);
 void pipe_atom_destroy(pipe_atom *atom);
 
-void pipe_init(struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom, int size);
+void pipe_init(struct pipe *pipe, pipe_atom *ratom, pipe_atom *watom,
+		int size, int maxsize);
+void pipe_set_watermarks(struct pipe *pipe, int low, int high);
 void pipe_destroy(struct pipe *pipe);
 
 void pipe_io_proc(io_atom *aa, int flags);
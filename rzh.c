@@ -18,11 +18,13 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <setjmp.h>
+#include <signal.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <netdb.h>
 
 #include "log.h"
+#include "chain.h"
 #include "fifo.h"
 #include "io/io_socket.h"
 #include "pipe.h"
@@ -44,6 +46,7 @@ const char *download_dir = NULL;	// download files to this directory
 static jmp_buf g_bail;
 socket_addr conn_addr;
 int conn_fd = -1;
+static const char *stats_path;		// append io stats here, see --io-stats
 
 
 #if !defined(PATH_MAX)
@@ -74,6 +77,30 @@ void preabort(int val)
 }
 
 
+/** Appends the io stats to the --io-stats file.  The file is only
+ *  open while we write so forked children don't inherit it.
+ */
+
+static void dump_stats()
+{
+	FILE *fp = fopen(stats_path, "a");
+
+	if(fp == NULL) {
+		log_warn("Could not open %s: %s", stats_path, strerror(errno));
+		return;
+	}
+
+	io_stats_dump(fp);
+	fclose(fp);
+}
+
+
+static void stats_signal(int sig, void *refcon)
+{
+	dump_stats();
+}
+
+
 void rzh_fork_prepare()
 {
 	if(conn_fd > -1) {
@@ -248,9 +275,14 @@ static void usage()
 	printf(
 			"Usage: rzh [OPTION]... [DLDIR]\n"
 			"  -i --info    : tells if rzh is currently running or not.\n"
+			"     --io=NAME : event loop to use: %s (default %s).\n"
+			"                 The RZH_IO environment variable does the same.\n"
+			"     --io-stats=FILE : count where the event loop spends its time\n"
+			"                 and append it to FILE on exit or SIGUSR1.\n"
 			"  -V --version : print the version of this program.\n"
 			"  -h --help    : prints this help text\n"
-			"Run rzh with no arguments to receive files into the current directory.\n"
+			"Run rzh with no arguments to receive files into the current directory.\n",
+			io_backend_names(), io_backend_name()
 		  );
 }
 
@@ -270,6 +302,16 @@ static void process_args(int argc, char **argv)
 		CONNECT_ADDR,
 		INMA_FIFO_SIZE,
 		MAOU_FIFO_SIZE,
+		FIFO_MAX_SIZE,
+		FIFO_SPILL_SIZE,
+		READ_BUDGET,
+		READ_COUNT,
+		HIGH_WATER,
+		LOW_WATER,
+		NO_SPLICE,
+		NO_COALESCE,
+		IO_BACKEND,
+		IO_STATS,
 	};
 
 	while(1) {
@@ -283,12 +325,22 @@ static void process_args(int argc, char **argv)
 			{"version", 0, 0, 'V'},
 
 			{"rz", 1, 0, RZ_CMD},		// unfinished
+			{"io", 1, 0, IO_BACKEND},
+			{"io-stats", 1, 0, IO_STATS},
 
 #ifndef NDEBUG
 			{"connect", 1, 0, CONNECT_ADDR},
 			{"debug-attach", 0, 0, 'D'},
 			{"fifo-inma", 1, 0, INMA_FIFO_SIZE},
 			{"fifo-maout", 1, 0, MAOU_FIFO_SIZE},
+			{"fifo-max", 1, 0, FIFO_MAX_SIZE},
+			{"fifo-spill", 1, 0, FIFO_SPILL_SIZE},
+			{"read-budget", 1, 0, READ_BUDGET},
+			{"read-count", 1, 0, READ_COUNT},
+			{"high-water", 1, 0, HIGH_WATER},
+			{"low-water", 1, 0, LOW_WATER},
+			{"no-splice", 0, 0, NO_SPLICE},
+			{"no-coalesce", 0, 0, NO_COALESCE},
 			{"loglevel", 1, 0, LOG_LEVEL},
 			{"log-level", 1, 0, LOG_LEVEL},
 			{"logfile", 1, 0, LOG_FILE},
@@ -326,10 +378,24 @@ static void process_args(int argc, char **argv)
 				log_init(optarg);
 				break;
 
+			case NO_SPLICE:
+				pipe_splice = 0;
+				break;
+
+			case NO_COALESCE:
+				pipe_coalesce = 0;
+				break;
+
 			// options taking integer arguments
 			case LOG_LEVEL:
 			case INMA_FIFO_SIZE:
 			case MAOU_FIFO_SIZE:
+			case FIFO_MAX_SIZE:
+			case FIFO_SPILL_SIZE:
+			case READ_BUDGET:
+			case READ_COUNT:
+			case HIGH_WATER:
+			case LOW_WATER:
 				if(!io_safe_atoi(optarg, &i)) {
 					fprintf(stderr, "Invalid number: \"%s\"\n", optarg);
 					exit(argument_error);
@@ -357,6 +423,45 @@ static void process_args(int argc, char **argv)
 						}
 						break;
 
+					case FIFO_MAX_SIZE:
+					case FIFO_SPILL_SIZE:
+						if(i < 0 || i > 1024*1024*1024) {
+							fprintf(stderr, "Value out of range: %d\n", i);
+							exit(argument_error);
+						}
+						if(c == FIFO_MAX_SIZE) {
+							inma_fifo_max = maou_fifo_max = i;
+						} else {
+							fifo_spill_size = i;
+						}
+						break;
+
+					case READ_BUDGET:
+					case READ_COUNT:
+						if(i < 1) {
+							fprintf(stderr, "Value out of range: %d\n", i);
+							exit(argument_error);
+						}
+						if(c == READ_BUDGET) {
+							pipe_read_budget = i;
+						} else {
+							pipe_read_count = i;
+						}
+						break;
+
+					case HIGH_WATER:
+					case LOW_WATER:
+						if(i < 0 || i > 1024*1024*1024) {
+							fprintf(stderr, "Value out of range: %d\n", i);
+							exit(argument_error);
+						}
+						if(c == HIGH_WATER) {
+							pipe_high_water = i;
+						} else {
+							pipe_low_water = i;
+						}
+						break;
+
 					default:
 						assert(!"No handler for option");
 
@@ -367,7 +472,19 @@ static void process_args(int argc, char **argv)
 			case 'i':
 				get_info();
 				break;
+
+			case IO_BACKEND:
+				if(io_use(optarg) < 0) {
+					fprintf(stderr, "Unknown io backend \"%s\".  Use one of: %s\n",
+							optarg, io_backend_names());
+					exit(argument_error);
+				}
+				break;
 			
+			case IO_STATS:
+				stats_path = optarg;
+				break;
+
 			case 'q':
 				opt_quiet++;
 				break;
@@ -421,17 +538,26 @@ int main(int argc, char **argv)
 
 	log_set_priority(0);
 
-	// We do not ensure that io_exit is called after forking but
-	// before execing.  For select this is OK.  If we move to a
-	// fd-based select scheme, though, it may be an issue.
-	io_init();
-
 	cmd_init(&rzcmd);
 	conn_addr.addr.s_addr = inet_addr("127.0.0.1");
 	conn_addr.port = 0;
 
 	process_args(argc, argv);
 
+	// We do not ensure that io_exit is called after forking but
+	// before execing.  For select this is OK.  The epoll fd is
+	// close-on-exec so that's OK too.  So is the io_uring fd, and
+	// the child unmaps its rings as soon as it's forked.
+	io_init();
+
+	if(stats_path) {
+		io_stats_start();
+		io_stats_name(pipe_io_proc, "pipe_io_proc");
+		if(io_signal_add(SIGUSR1, stats_signal, NULL) < 0) {
+			log_warn("Could not watch SIGUSR1, io stats only dumped on exit");
+		}
+	}
+
 	if(rzcmd.path == NULL) {
 		// if user didn't specify the rzcmd to use, load default
 		cmd_parse(&rzcmd, DEFAULT_RZ_COMMAND);
@@ -458,12 +584,12 @@ int main(int argc, char **argv)
 			// main loop, only ends through longjmp
 			int time = master_idle(mp);
 			log_dbg("loop...   timeout=%d", time);
+			pipe_flush_dirty();		// whatever master_idle printed
 			io_wait(time);
+			// (exited children are dispatched after the fd events so any
+			// data that a dying child left behind is read first)
 			io_dispatch();
-			// Turns out we need to dispatch before handling sigchlds.
-			// Otherwise, since the sigchld probably causes fds to open
-			// and close, we end up dispatching on stale events.  Bad.
-			master_check_sigchild(mp);
+			pipe_flush_dirty();
 		}
 	}
 	if(val == 1) {
@@ -472,6 +598,10 @@ int main(int argc, char **argv)
 		val = 0;
 	}
 
+	if(stats_path) {
+		dump_stats();
+	}
+
 	cmd_free(&rzcmd);
 
 	if(val == 0) {
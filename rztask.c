@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #include "log.h"
+#include "chain.h"
 #include "fifo.h"
 #include "io/io.h"
 #include "cmd.h"
@@ -20,6 +21,7 @@
 #include "task.h"
 #include "rztask.h"
 #include "util.h"
+#include "zseq.h"
 #include "zrq.h"
 #include "zfin.h"
 #include "idle.h"
@@ -28,6 +30,43 @@
 command rzcmd;	// specifies the rz executable we should run.
 
 
+/** What lrzsz sends to cancel a transfer: enough CANs to abort even
+ *  after a ZDLE, then backspaces to erase them from a terminal.
+ */
+
+static const char zabort[] =
+	"\030\030\030\030\030\030\030\030\030\030"
+	"\010\010\010\010\010\010\010\010\010\010";
+
+
+/** Stops the transfer now.  Nothing more from rz reaches the sender,
+ *  whatever the sender prints from here on (its abort message and the
+ *  shell prompt) is saved for the terminal, and rz is killed.  The
+ *  task goes away as soon as its SIGCHLD arrives.
+ */
+
+static void rz_abort(master_pipe *mp)
+{
+	fifo_set_proc(&mp->input_master.fifo, zfin_drop);
+	fifo_set_proc(&mp->master_output.fifo, zfin_save);
+	task_terminate(mp);
+}
+
+
+/** zfin_scan saw an abort go by.  The CANs have already been passed
+ *  on so whoever is at the far end sees them too.
+ */
+
+static void rz_aborted(struct fifo *f, const char *buf, int size, int fd)
+{
+	zfinscanstate *state = (zfinscanstate*)f->refcon;
+
+	log_info("Transfer aborted on %d", fd);
+	rz_abort(state->master);
+	(*f->proc)(f, buf, size, fd);
+}
+
+
 static void parse_typing(const char *buf, int len, void *refcon)
 {
 	int i;
@@ -41,8 +80,14 @@ static void parse_typing(const char *buf, int len, void *refcon)
 			case 'q':
 			case 'Q':
 				log_info("TYPING: Cancel!");
-				task_terminate(spec->master);
-				break;
+				if(spec->master->input_master.fifo.proc != zfin_drop) {
+					// cut rz off first so none of its output can
+					// follow the abort up to the sender.
+					fifo_set_proc(&spec->master->input_master.fifo, zfin_drop);
+					pipe_write(&spec->master->input_master, zabort, sizeof(zabort)-1);
+				}
+				rz_abort(spec->master);
+				return;
 
 			default:
 				fprintf(stderr, "KEY: len=%d <<%.*s>>\r\n", len, len, buf);
@@ -70,10 +115,15 @@ static void typing_io_proc(io_atom *inatom, int flags)
 
 	do {
 		errno = 0;
-		cnt = read(atom->atom.fd, buf, sizeof(buf));
+		cnt = io_read(atom->atom.fd, buf, sizeof(buf));
 	} while(cnt == -1 && errno == EINTR);
 
 	if(cnt > 0) {
+		// a full buffer means there's probably more, and edge-triggered
+		// io won't tell us about it again.
+		if(cnt == sizeof(buf)) {
+			io_again(&atom->atom, IO_READ);
+		}
 		parse_typing(buf, cnt, (void*)atom->read_pipe);
 	} else if(cnt == 0) {
 		log_warn("TYPING 0 read???");
@@ -98,7 +148,7 @@ static void cherr_proc(io_atom *inatom, int flags)
 
 	do {
 		errno = 0;
-		cnt = read(atom->atom.fd, buf, sizeof(buf));
+		cnt = io_read(atom->atom.fd, buf, sizeof(buf));
 	} while(cnt == -1 && errno == EINTR);
 
 	if(cnt > 0) {
@@ -106,6 +156,9 @@ static void cherr_proc(io_atom *inatom, int flags)
 		// Yes, but need to suppress
 		// 		"rz waiting to receive."
 		log_warn("CHILD STDERR fd=%d: <<<%.*s>>>", atom->atom.fd, cnt, buf);
+		if(cnt == sizeof(buf)) {
+			io_again(&atom->atom, IO_READ);
+		}
 	} else if(cnt == 0) {
 		// eof on stderr.
 		io_del(&atom->atom);
@@ -120,17 +173,27 @@ static void cherr_proc(io_atom *inatom, int flags)
 
 static void rzt_destructor_proc(task_spec *spec, int free_mem)
 {
+	struct fifo *maf = &spec->master->master_output.fifo;
+	uint64_t rzend = fifo_end_pos(maf);
+
 	idle_end(spec);
 
 	log_dbg("rztask destructor called.");
 
+	// Everything that was in the fifo before idle_end queued its
+	// summary was meant for rz (an abort, say, if rz was killed before
+	// it could be written).  Don't show it to the terminal.
+	if(fifo_beg_pos(maf) < rzend) {
+		log_info("DISCARD %d bytes meant for rz", (int)(rzend - fifo_beg_pos(maf)));
+		maf->beg = rzend;
+	}
+
 	// if the maout zfin scanner saved some text for us, we
 	// need to manually re-insert it into the pipe.
 	zfinscanstate *maout = (zfinscanstate*)spec->maout_refcon;
-	if(maout->savebuf) {
-		log_dbg("RESTORE %d saved bytes into pipe: %s",
-				maout->savecnt, sanitize(maout->savebuf, maout->savecnt));
-		pipe_write(&spec->master->master_output, maout->savebuf, maout->savecnt);
+	if(!chain_empty(&maout->save)) {
+		log_dbg("RESTORE %d saved bytes into pipe", chain_count(&maout->save));
+		pipe_write_chain(&spec->master->master_output, &maout->save);
 	}
 
 	if(free_mem) {
@@ -154,16 +217,19 @@ static task_spec* rz_create_spec(master_pipe *mp, int fd[3], int child_pid)
 	spec->child_pid = child_pid;
 
 	spec->inma_proc = zfin_scan;
-	spec->inma_refcon = zfin_create(mp, zfin_term);
+	spec->inma_peek = zfin_peek;
+	spec->inma_refcon = zfin_create(mp, zfin_term, rz_aborted);
 	spec->maout_proc = zfin_scan;
-	spec->maout_refcon = zfin_create(mp, zfin_nooo);
+	spec->maout_peek = zfin_peek;
+	spec->maout_refcon = zfin_create(mp, zfin_nooo, rz_aborted);
 	
-	spec->idle_proc = idle_proc;
-	spec->idle_refcon = idle_create(mp, "rz");
+	spec->idle_refcon = idle_create(spec, mp, "rz");
 
 	spec->destruct_proc = rzt_destructor_proc;
 	spec->err_proc = cherr_proc;
 	spec->verso_input_proc = typing_io_proc;
+	io_stats_name(cherr_proc, "cherr_proc");
+	io_stats_name(typing_io_proc, "typing_io_proc");
 	spec->verso_input_refcon = spec;
 
 	return spec;
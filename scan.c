@@ -0,0 +1,224 @@
+/* scan.c
+ * Scott Bronson
+ *
+ * Vector kernels for finding bytes in the data that flows through the
+ * scanners.  Everything the shell prints passes zrq_scan so skipping
+ * the uninteresting stretches needs to cost about as much as reading
+ * them.
+ *
+ * Each kernel compares 64 bytes per step against both needles and
+ * turns the result into a 64-bit mask so the position of the first
+ * hit is one count-trailing-zeros away.  SSE2 is always there on
+ * x86-64.  AVX2 and AVX-512 kernels are compiled with target
+ * attributes and used only if cpuid says the cpu has them.  Other
+ * architectures get the scalar loop.
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+
+typedef const char* (*scan2_proc)(const char *cp, const char *ce, int a, int b);
+
+
+static const char* scan2_scalar(const char *cp, const char *ce, int a, int b)
+{
+	while(cp < ce && *cp != (char)a && *cp != (char)b) {
+		cp++;
+	}
+
+	return cp;
+}
+
+
+#ifdef SCAN_X86
+
+static const char* scan2_sse2(const char *cp, const char *ce, int a, int b)
+{
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	__m128i v0, v1, v2, v3;
+	unsigned long long mask;
+
+	while(ce - cp >= 64) {
+		v0 = _mm_loadu_si128((const __m128i*)cp);
+		v1 = _mm_loadu_si128((const __m128i*)(cp + 16));
+		v2 = _mm_loadu_si128((const __m128i*)(cp + 32));
+		v3 = _mm_loadu_si128((const __m128i*)(cp + 48));
+		v0 = _mm_or_si128(_mm_cmpeq_epi8(v0, va), _mm_cmpeq_epi8(v0, vb));
+		v1 = _mm_or_si128(_mm_cmpeq_epi8(v1, va), _mm_cmpeq_epi8(v1, vb));
+		v2 = _mm_or_si128(_mm_cmpeq_epi8(v2, va), _mm_cmpeq_epi8(v2, vb));
+		v3 = _mm_or_si128(_mm_cmpeq_epi8(v3, va), _mm_cmpeq_epi8(v3, vb));
+
+		// test all four at once before building the mask
+		if(_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(v0, v1),
+						_mm_or_si128(v2, v3)))) {
+			mask = (unsigned)_mm_movemask_epi8(v0) |
+				(unsigned long long)(unsigned)_mm_movemask_epi8(v1) << 16 |
+				(unsigned long long)(unsigned)_mm_movemask_epi8(v2) << 32 |
+				(unsigned long long)(unsigned)_mm_movemask_epi8(v3) << 48;
+			return cp + __builtin_ctzll(mask);
+		}
+		cp += 64;
+	}
+
+	while(ce - cp >= 16) {
+		v0 = _mm_loadu_si128((const __m128i*)cp);
+		v0 = _mm_or_si128(_mm_cmpeq_epi8(v0, va), _mm_cmpeq_epi8(v0, vb));
+		mask = (unsigned)_mm_movemask_epi8(v0);
+		if(mask) {
+			return cp + __builtin_ctzll(mask);
+		}
+		cp += 16;
+	}
+
+	return scan2_scalar(cp, ce, a, b);
+}
+
+
+__attribute__((target("avx2")))
+static const char* scan2_avx2(const char *cp, const char *ce, int a, int b)
+{
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+	__m256i v0, v1;
+	unsigned long long mask;
+
+	while(ce - cp >= 64) {
+		v0 = _mm256_loadu_si256((const __m256i*)cp);
+		v1 = _mm256_loadu_si256((const __m256i*)(cp + 32));
+		v0 = _mm256_or_si256(_mm256_cmpeq_epi8(v0, va), _mm256_cmpeq_epi8(v0, vb));
+		v1 = _mm256_or_si256(_mm256_cmpeq_epi8(v1, va), _mm256_cmpeq_epi8(v1, vb));
+		if(!_mm256_testz_si256(_mm256_or_si256(v0, v1), _mm256_or_si256(v0, v1))) {
+			mask = (unsigned)_mm256_movemask_epi8(v0) |
+				(unsigned long long)(unsigned)_mm256_movemask_epi8(v1) << 32;
+			return cp + __builtin_ctzll(mask);
+		}
+		cp += 64;
+	}
+
+	// gcc doesn't clean the upper halves before a tail call and
+	// running SSE code with them dirty is very slow
+	_mm256_zeroupper();
+	return scan2_sse2(cp, ce, a, b);
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static const char* scan2_avx512(const char *cp, const char *ce, int a, int b)
+{
+	const __m512i va = _mm512_set1_epi8(a);
+	const __m512i vb = _mm512_set1_epi8(b);
+	__m512i v;
+	unsigned long long mask;
+
+	while(ce - cp >= 64) {
+		v = _mm512_loadu_si512((const void*)cp);
+		mask = _mm512_cmpeq_epi8_mask(v, va) | _mm512_cmpeq_epi8_mask(v, vb);
+		if(mask) {
+			return cp + __builtin_ctzll(mask);
+		}
+		cp += 64;
+	}
+
+	// the tail is too short for 512 bits to pay off
+	_mm256_zeroupper();
+	return scan2_sse2(cp, ce, a, b);
+}
+
+#endif
+
+
+static const struct kernel {
+	const char *name;
+	scan2_proc find2;
+} kernels[] = {
+#ifdef SCAN_X86
+	{ "avx512", scan2_avx512 },
+	{ "avx2", scan2_avx2 },
+	{ "sse2", scan2_sse2 },
+#endif
+	{ "scalar", scan2_scalar },
+};
+
+#define NKERNELS (sizeof(kernels)/sizeof(kernels[0]))
+
+
+static const struct kernel *kernel;
+
+
+static int supported(const struct kernel *k)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if(k->find2 == scan2_avx512) {
+		return __builtin_cpu_supports("avx512bw");
+	}
+	if(k->find2 == scan2_avx2) {
+		return __builtin_cpu_supports("avx2");
+	}
+#endif
+	return 1;
+}
+
+
+/** Picks the fastest kernel that this cpu can run. */
+
+static void choose()
+{
+	unsigned int i;
+
+	for(i=0; i<NKERNELS; i++) {
+		if(supported(&kernels[i])) {
+			kernel = &kernels[i];
+			return;
+		}
+	}
+}
+
+
+int scan_use(const char *name)
+{
+	unsigned int i;
+
+	for(i=0; i<NKERNELS; i++) {
+		if(strcmp(kernels[i].name, name) == 0) {
+			if(!supported(&kernels[i])) {
+				return -1;
+			}
+			kernel = &kernels[i];
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+const char* scan_kernel_name()
+{
+	if(!kernel) {
+		choose();
+	}
+
+	return kernel->name;
+}
+
+
+const char* scan_find2(const char *cp, const char *ce, int a, int b)
+{
+	if(!kernel) {
+		choose();
+	}
+
+	return (*kernel->find2)(cp, ce, a, b);
+}
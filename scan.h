@@ -0,0 +1,36 @@
+/* scan.h
+ * Scott Bronson
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+#include <string.h>
+
+
+/* Returns the first byte in cp..ce that is a or b, or ce if there
+ * isn't one.  On x86 this compares 64 bytes per step using the widest
+ * vector unit the cpu has (picked the first time it's called).
+ */
+
+const char* scan_find2(const char *cp, const char *ce, int a, int b);
+
+
+/* Same as scan_find2 for one byte.  libc's memchr already has tuned
+ * vector kernels so this just calls it.
+ */
+
+static inline const char* scan_find1(const char *cp, const char *ce, int a)
+{
+	const char *p = memchr(cp, a, ce - cp);
+	return p ? p : ce;
+}
+
+
+/* Forces a kernel: "scalar", "sse2", "avx2" or "avx512".  Returns -1
+ * if it isn't compiled in or this cpu can't run it.  Mostly for
+ * fifobench.
+ */
+
+int scan_use(const char *name);
+const char* scan_kernel_name();
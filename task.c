@@ -5,6 +5,7 @@
 
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,7 @@
 #include <signal.h>
 
 #include "log.h"
+#include "chain.h"
 #include "fifo.h"
 #include "io/io.h"
 #include "pipe.h"
@@ -20,8 +22,22 @@
 #include "util.h"
 
 
-int inma_fifo_size = 8192;
-int maou_fifo_size = 8192;
+// The fifos start out a page long and inflate if the writer stalls.
+int inma_fifo_size = 4096;
+int maou_fifo_size = 4096;
+int inma_fifo_max = 16*1024*1024;
+int maou_fifo_max = 16*1024*1024;
+
+
+/** Called from the event loop when the task's child exits. */
+
+static void task_child_exited(int pid, int status, void *refcon)
+{
+	task_state *task = refcon;
+
+	log_dbg("child %d exited, status=%d", pid, status);
+	(*task->spec->sigchild_proc)(task->spec->master, task->spec, pid);
+}
 
 
 /** This uses the spec to set up all the memory and atoms
@@ -65,6 +81,16 @@ static task_state* task_prepare(task_spec *spec)
 		task->err_atom.atom.fd = -1;
 	}
 
+	io_child_init(&task->child);
+	if(spec->child_pid > 0) {
+		err = io_child_add(&task->child, spec->child_pid, task_child_exited, task);
+		if(err != 0) {
+			fprintf(stderr, "%d (%s) watching child %d",
+					err, strerror(-err), spec->child_pid);
+			bail(73);
+		}
+	}
+
 	task->next = NULL;
 	task->spec = spec;
 
@@ -90,6 +116,7 @@ static void task_destroy(task_state *task, int free_mem)
 				task->err_atom.atom.fd);
 		io_del(&task->err_atom.atom);
 	}
+	io_child_del(&task->child);
 
 	(*task->spec->destruct_proc)(task->spec, free_mem);
 
@@ -135,16 +162,21 @@ static void task_pipe_setup(master_pipe *mp)
 	mp->master_output.write_atom = &task->write_atom;
 	task->write_atom.write_pipe = &mp->master_output;
 
-	// New reader so reset the read status
-	mp->input_master.block_read = 0;
-	if(mp->input_master.read_atom->atom.fd >= 0) {
+	// New reader so reset the read status.  It stays blocked if the
+	// pipe is still over its high water mark.
+	mp->input_master.block_read = (pipe_count(&mp->input_master) >=
+			mp->input_master.high_water);
+	if(!mp->input_master.block_read &&
+			mp->input_master.read_atom->atom.fd >= 0) {
 		io_enable(&mp->input_master.read_atom->atom, IO_READ);
 	}
 
 	// Ensure the fifo procs are set up
-	mp->input_master.fifo.proc = task->spec->inma_proc;
+	fifo_set_proc(&mp->input_master.fifo, task->spec->inma_proc);
+	mp->input_master.fifo.peek = task->spec->inma_peek;
 	mp->input_master.fifo.refcon = task->spec->inma_refcon;
-	mp->master_output.fifo.proc = task->spec->maout_proc;
+	fifo_set_proc(&mp->master_output.fifo, task->spec->maout_proc);
+	mp->master_output.fifo.peek = task->spec->maout_peek;
 	mp->master_output.fifo.refcon = task->spec->maout_refcon;
 }
 
@@ -241,6 +273,7 @@ static task_state* master_pipe_find_task(master_pipe *mp, task_spec *spec)
 		if(task->spec == spec) {
 			return task;
 		}
+		task = task->next;
 	}
 
 	return NULL;
@@ -250,35 +283,34 @@ static task_state* master_pipe_find_task(master_pipe *mp, task_spec *spec)
 void task_default_sigchild(master_pipe *mp, task_spec *spec, int pid)
 {
 	task_state *task;
-	// TODO: technically, calling printf inside a signal handler is
-	// illegal.  Get rid of these logging calls eventually.
-
-	if(pid != spec->child_pid) {
-		// nothing to do if it's not our child.
-		return;
-	}
 
-	log_dbg("handling SIGCHLD for pid %d", pid);
+	log_dbg("handling exit of child %d", pid);
 
 	task = master_pipe_find_task(mp, spec);
 	assert(task);
 	assert(task->spec == spec);
 
-	while(task && task->read_atom.atom.fd != -1) {
-		// We got a sigchld for this task, but the reader hasn't
-		// been closed yet.  This means there's probably a touch
-		// more data in the read pipe.  Read it to exhaustion.
-		while(task->read_atom.atom.fd != -1) {
-			// probably we just found the eof and no actual data.
-			log_info("Found extra data in pipe %d:", task->read_atom.atom.fd);
-			pipe_io_proc(&task->read_atom.atom, IO_READ);
-		}
-		if(mp->input_master.write_atom->atom.fd >= 0) {
-			log_info("Wrote extra %d bytes of data to %d", fifo_count(&mp->input_master.fifo), mp->input_master.write_atom->atom.fd);
-			fifo_write(&mp->input_master.fifo, mp->input_master.write_atom->atom.fd);
+	// We got a sigchld for this task, but the reader hasn't been
+	// closed yet.  This means there's probably a touch more data in
+	// the read pipe.  Read it to exhaustion.  The pipe writes it out
+	// as it goes (in order, after anything already queued), so stop
+	// if the pipe fills up or the fd has nothing more to give rather
+	// than spinning here.
+	while(task->read_atom.atom.fd != -1 && !mp->input_master.block_read) {
+		// probably we just found the eof and no actual data.
+		log_info("Found extra data in pipe %d:", task->read_atom.atom.fd);
+		errno = 0;
+		pipe_io_proc(&task->read_atom.atom, IO_READ);
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
 		}
 	}
 
+	if(pipe_count(&mp->input_master)) {
+		log_info("Writing extra %d bytes of data", pipe_count(&mp->input_master));
+		pipe_flush(&mp->input_master);
+	}
+
 	if(spec == mp->task_head->spec) {
 		// And it's topmost so just remove it
 		if(!fifo_empty(&mp->input_master.fifo)) {
@@ -362,27 +394,6 @@ void task_fork_prepare(master_pipe *mp)
 }
 
 
-/** This calls each sigchild handler when we receive a SIGCHLD,
- *  regardless of pid.
- */
-
-void task_dispatch_sigchild(master_pipe *mp, int pid)
-{
-	task_state *task = mp->task_head;
-	task_state *ntask;
-
-	while(task) {
-		// since the task may be disposed when we call its sigchild_proc,
-		// we need to copy everything we need first.
-		ntask = task->next;
-		(*task->spec->sigchild_proc)(mp, task->spec, pid);
-		task = ntask;
-	}
-
-	(*mp->sigchild_proc)(mp, pid);
-}
-
-
 /** The default destructor for master pipes.
  *  free_mem is set to 0 if we're forking, or 1 if we're quitting.
  *  No need to free mem before forking since everything will be
@@ -402,12 +413,6 @@ void master_pipe_default_destructor(master_pipe *mp, int free_mem)
 }
 
 
-void master_pipe_default_sigchild(master_pipe *mp, int pid)
-{
-	// do nothing
-}
-
-
 void master_pipe_default_terminate(master_pipe *mp)
 {
 	// do nothing
@@ -427,11 +432,16 @@ master_pipe* master_pipe_init(int masterfd)
 
 	pipe_atom_init(&mp->master_atom, masterfd);
 
-	pipe_init(&mp->input_master, NULL, &mp->master_atom, inma_fifo_size);
-	pipe_init(&mp->master_output, &mp->master_atom, NULL, maou_fifo_size);
+	pipe_init(&mp->input_master, NULL, &mp->master_atom,
+			inma_fifo_size, inma_fifo_max);
+	pipe_init(&mp->master_output, &mp->master_atom, NULL,
+			maou_fifo_size, maou_fifo_max);
+
+	// Keystrokes need to be echoed immediately but there's no need
+	// to write every little scrap of output the moment it arrives.
+	mp->master_output.coalesce = 1;
 
 	mp->destruct_proc = master_pipe_default_destructor;
-	mp->sigchild_proc = master_pipe_default_sigchild;
 	mp->terminate_proc = master_pipe_default_terminate;
 
 	mp->task_head = NULL;
@@ -26,6 +26,8 @@ typedef struct task_spec {
 	void *inma_refcon;		///< and the refcon to pass to it.
 	fifo_proc maout_proc;	///< proc to process the data flowing from master to output.
 	void *maout_refcon;		///< and the refcon to pass to it.
+	fifo_peek_proc inma_peek;	///< optional, tells how much data inma_proc would pass through untouched so it can be spliced.
+	fifo_peek_proc maout_peek;	///< same for maout_proc.
 
 	io_proc err_proc;		///< This routine is called every time something arrives on stderr.
 	void *err_refcon;
@@ -35,18 +37,14 @@ typedef struct task_spec {
 	// Right now, verso output is a complete hack.  It works though.
 	// The entire pipe_atom is available for use by the verso read proc, since it gets entirely reset by task_pipe_setup.  Cool!
 
-/** The idle proc of the topmost task gets called once each time through
- *  the event loop.  It returns the number of milliseconds that should
- *  elapse before being called again.  Note that it is called EVERY time
- *  through the event loop so it will probably get called much more
- *  often than it requests.
+/** Tasks that need to do something periodically (like update a
+ *  progress display) should use an io_timer.
  */
 
-	int (*idle_proc)(struct task_spec*);			///< The idle proc to call when this task is topmost.
-	void *idle_refcon;								///< Any data you want to associate explicitly with the idle proc.
+	void *idle_refcon;								///< Any data you want to associate explicitly with the task's idle display.
 
 	void (*destruct_proc)(struct task_spec*, int free_mem);	///< Called when the task gets removed so the task_spec is no longer needed (unless you want to reuse it of course).  This routine is to free all memory, etc.  If forking is true, then we're running in a child that is about to exec, so close all filehandles but don't worry about memory.  The new task is established, but no I/O has occurred, when the previous task's destructor is called.
-	void (*sigchild_proc)(struct master_pipe*, struct task_spec*, int pid);	///< The SIGCHLD handler for this task.  See task_sigchild() for more.  This is set to task_default_sigchild by default.  If your task doesn't involve forked children, just leave task_spec::child_pid set to -1.
+	void (*sigchild_proc)(struct master_pipe*, struct task_spec*, int pid);	///< Called when the task's child (task_spec::child_pid) exits.  This is set to task_default_sigchild by default.  If your task doesn't involve forked children, just leave task_spec::child_pid set to -1.
 	void (*terminate_proc)(struct master_pipe*, struct task_spec*);
 
 	struct master_pipe *master;
@@ -66,6 +64,7 @@ typedef struct task_state {
 	pipe_atom read_atom;		///< The input (input -> master)
 	pipe_atom write_atom;		///< The output (master -> output)
 	heavy_atom  err_atom;			///< The error (a proc is called but no pipes are provided)
+	io_child child;				///< Watches spec->child_pid, if there is one.
 	struct task_state *next;	///< The next task downward.  When this task is removed, the next task will take over.
 	task_spec *spec;			///< The spec that this task was created from.
 } task_state;
@@ -81,7 +80,6 @@ typedef struct master_pipe {
 	struct pipe input_master;	///< The pipe shuttling data from the input to the master.
 	struct pipe master_output;	///< The pipe shuttling data from the master to the output.
 	void (*destruct_proc)(struct master_pipe*, int free_mem);	///< Called when the last task is removed from the pipe.
-	void (*sigchild_proc)(struct master_pipe*, int pid);	///< The SIGCHLD handler for this task.  See task_sigchild() for more.  This is set to task_default_sigchild by default.  If your task doesn't involve forked children, just leave task_spec::child_pid set to -1.
 	void (*terminate_proc)(struct master_pipe*);
 	task_state *task_head;		///< the tasks in order from topmost to bottommost.
 	void *refcon;				///< Used for whatever the pipe wants (not used by task code).
@@ -90,6 +88,8 @@ typedef struct master_pipe {
 
 extern int inma_fifo_size;
 extern int maou_fifo_size;
+extern int inma_fifo_max;
+extern int maou_fifo_max;
 
 void task_install(master_pipe *mp, task_spec *spec);
 void task_remove(master_pipe *mp);
@@ -99,7 +99,6 @@ void task_terminate(master_pipe *mp);
 task_spec* task_create_spec(void);
 void task_default_destructor(task_spec *spec, int free_mem);
 
-void task_dispatch_sigchild(master_pipe *mp, int pid);
 void task_fork_prepare(master_pipe *mp);
 
 master_pipe* master_pipe_init(int masterfd);
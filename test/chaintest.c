@@ -0,0 +1,232 @@
+/* chaintest.c
+ * Scott Bronson
+ *
+ * Tests the refcounted buffer chains (chain.c): appending, prepending,
+ * splitting one chain into two, consuming, and that slabs shared by
+ * both halves of a split are only freed once nobody uses them.
+ *
+ * Run "make test" in the top-level directory or "make chaintest" here.
+ * Prints each failure and exits nonzero if there were any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "../chain.h"
+
+
+static int checks, failures;
+
+
+// provided by rzh
+void bail(int val)
+{
+	fprintf(stderr, "bailed with %d\n", val);
+	exit(val);
+}
+
+
+static void check(int ok, const char *what, const char *name)
+{
+	checks += 1;
+	if(!ok) {
+		failures += 1;
+		printf("FAIL %s: %s\n", name, what);
+	}
+}
+
+
+/** Checks that the chain holds exactly want, and that its count and
+ *  tail agree with its segments.
+ */
+
+static void check_chain(struct chain *c, const char *want, const char *name)
+{
+	struct iovec iov[256];
+	struct chain_seg *seg;
+	char out[8192];
+	int n, i, len = 0;
+
+	n = chain_iov(c, iov, 256);
+	for(i=0; i<n; i++) {
+		memcpy(out + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	for(seg=c->head; seg && seg->next; seg=seg->next) {
+		// (find the last segment)
+	}
+
+	check(len == strlen(want) && memcmp(out, want, len) == 0, "wrong contents", name);
+	check(c->count == len, "wrong count", name);
+	check(c->tail == seg, "wrong tail", name);
+	check(chain_empty(c) == (len == 0), "wrong empty", name);
+}
+
+
+static void test_append()
+{
+	struct chain c;
+	char big[6000];
+
+	chain_init(&c);
+	check_chain(&c, "", "new chain");
+
+	chain_append(&c, "hello", 5);
+	chain_append(&c, ", world", 7);
+	check_chain(&c, "hello, world", "append");
+	check(c.head == c.tail, "little appends used more than one slab", "append");
+
+	chain_prepend(&c, ">> ", 3);
+	check_chain(&c, ">> hello, world", "prepend");
+	chain_append(&c, "!", 1);
+	check_chain(&c, ">> hello, world!", "append after prepend");
+
+	chain_destroy(&c);
+	check_chain(&c, "", "destroy");
+
+	chain_prepend(&c, "x", 1);
+	check_chain(&c, "x", "prepend to empty");
+
+	// bigger than a slab
+	memset(big, 'b', sizeof(big)-1);
+	big[sizeof(big)-1] = '\0';
+	chain_append(&c, big+1, sizeof(big)-2);
+	big[0] = 'x';
+	check_chain(&c, big, "append more than a slab");
+	chain_destroy(&c);
+}
+
+
+static void test_split()
+{
+	struct chain a, b;
+	struct chain_slab *slab;
+
+	chain_init(&a);
+	chain_init(&b);
+
+	chain_append(&a, "abcdefgh", 8);
+	slab = a.head->slab;
+
+	// a split in the middle of a segment shares its slab
+	chain_split(&a, 3, &b);
+	check_chain(&a, "defgh", "split src");
+	check_chain(&b, "abc", "split dst");
+	check(slab->refs == 2, "slab not shared", "split");
+
+	// neither half may write into the shared slab
+	chain_append(&b, "XY", 2);
+	chain_append(&a, "ij", 2);
+	check_chain(&a, "defghij", "append to split src");
+	check_chain(&b, "abcXY", "append to split dst");
+	check(a.head->slab == slab && a.head->len == 5, "src appended into shared slab", "split");
+
+	// consuming the dst's part of the slab doesn't free it
+	chain_consume(&b, 4);
+	check_chain(&b, "Y", "consume");
+	check(slab->refs == 1, "slab not released", "consume");
+	check_chain(&a, "defghij", "consume leaves src alone");
+
+	// whole segments just move
+	chain_split(&a, 7, &b);
+	check_chain(&a, "", "split everything src");
+	check_chain(&b, "Ydefghij", "split everything dst");
+
+	chain_split(&b, 0, &a);
+	check_chain(&a, "", "split nothing dst");
+	check_chain(&b, "Ydefghij", "split nothing src");
+
+	chain_move(&a, &b);
+	check_chain(&a, "Ydefghij", "move dst");
+	check_chain(&b, "", "move src");
+	chain_move(&a, &b);
+	check_chain(&a, "Ydefghij", "move empty");
+
+	chain_consume(&a, a.count);
+	check_chain(&a, "", "consume everything");
+	chain_destroy(&a);
+	chain_destroy(&b);
+}
+
+
+/** Does random things to a chain and compares it with a plain string.
+ *  The split-off pieces are kept around for a while so slabs stay
+ *  shared.
+ */
+
+static void test_random()
+{
+	struct chain c, parts[8];
+	char want[8192], buf[40];
+	int i, j, n, k, len = 0;
+	char name[32];
+
+	srand(1);
+	chain_init(&c);
+	for(j=0; j<8; j++) {
+		chain_init(&parts[j]);
+	}
+
+	for(i=0; i<3000; i++) {
+		n = rand() % 30;
+		for(j=0; j<n; j++) {
+			buf[j] = 'a' + rand() % 26;
+		}
+
+		switch(rand() % 5) {
+			case 0:
+			case 1:
+				if(len + n < sizeof(want)) {
+					chain_append(&c, buf, n);
+					memcpy(want + len, buf, n);
+					len += n;
+				}
+				break;
+			case 2:
+				if(len + n < sizeof(want)) {
+					chain_prepend(&c, buf, n);
+					memmove(want + n, want, len);
+					memcpy(want, buf, n);
+					len += n;
+				}
+				break;
+			case 3:
+				k = rand() % (len + 1);
+				j = rand() % 8;
+				chain_destroy(&parts[j]);
+				chain_split(&c, k, &parts[j]);
+				memmove(want, want + k, len - k);
+				len -= k;
+				break;
+			case 4:
+				k = rand() % (len + 1);
+				chain_consume(&c, k);
+				memmove(want, want + k, len - k);
+				len -= k;
+				break;
+		}
+
+		want[len] = '\0';
+		snprintf(name, sizeof(name), "random step %d", i);
+		check_chain(&c, want, name);
+	}
+
+	chain_destroy(&c);
+	for(j=0; j<8; j++) {
+		chain_destroy(&parts[j]);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	test_append();
+	test_split();
+	test_random();
+
+	printf("chaintest: %d checks, %d failures\n", checks, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,442 @@
+/* fifobench.c
+ * Scott Bronson
+ *
+ * Microbenchmarks for the fifo and pipe code.  Sweeps a range of
+ * fifo sizes and chunk sizes and prints the cost of each operation
+ * in nanoseconds per byte and, for the i/o tests, syscalls (or
+ * event loop iterations) per megabyte.
+ *
+ * Run "make bench" in the top-level directory.
+ *
+ * The pipe test is run once with each io backend and the scan test
+ * once with each scan kernel.
+ *
+ *   -q  quick run: move less data per test
+ *   -s  don't splice, copy everything through the pipe's fifo
+ *   -t  only run tests whose names contain this string
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+
+#include "../chain.h"
+#include "../fifo.h"
+#include "../filter.h"
+#include "../io/io.h"
+#include "../pipe.h"
+#include "../scan.h"
+
+#define exit_cmdline_error 1
+
+static int fifo_sizes[] = { 256, 4096, 65536, 1024*1024, 0 };
+static int chunk_sizes[] = { 1, 64, 1024, 16384, 0 };
+
+static long opt_bytes = 64*1024*1024;	// most data moved by each test
+static long bytes;						// data moved by the current test
+static const char *opt_test = NULL;
+
+
+// provided by rzh
+void bail(int val)
+{
+	fprintf(stderr, "bailed with %d\n", val);
+	exit(val);
+}
+
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void report(const char *test, const char *kind, int size, int chunk,
+		double secs, long cnt, long calls)
+{
+	printf("%-8s %-15s size=%-8d chunk=%-6d %8.3f ns/byte", test, kind,
+			size, chunk, secs * 1e9 / cnt);
+	if(calls >= 0) {
+		printf("  %10.1f %s/MB", calls * 1048576.0 / cnt,
+				strcmp(test, "pipe") == 0 ? "loops" : "syscalls");
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+
+static int want(const char *test)
+{
+	return opt_test == NULL || strstr(test, opt_test) != NULL;
+}
+
+
+static void fifo_setup(struct fifo *f, int size)
+{
+	if(!fifo_init(f, size, size)) {
+		perror("fifo_init");
+		exit(2);
+	}
+}
+
+
+/** fifo_unsafe_append followed by fifo_unsafe_unpend */
+
+static void bench_append(int size, int chunk, char *buf)
+{
+	struct fifo f;
+	long done;
+	double t;
+
+	fifo_setup(&f, size);
+	t = now();
+	for(done=0; done<bytes; done+=chunk) {
+		fifo_unsafe_append(&f, buf, chunk);
+		fifo_unsafe_unpend(&f, buf, chunk);
+	}
+	report("append", "mem", size, chunk, now() - t, done, -1);
+	fifo_destroy(&f);
+}
+
+
+/** fifo_unsafe_prepend followed by fifo_unsafe_unpend */
+
+static void bench_prepend(int size, int chunk, char *buf)
+{
+	struct fifo f;
+	long done;
+	double t;
+
+	fifo_setup(&f, size);
+	t = now();
+	for(done=0; done<bytes; done+=chunk) {
+		fifo_unsafe_prepend(&f, buf, chunk);
+		fifo_unsafe_unpend(&f, buf, chunk);
+	}
+	report("prepend", "mem", size, chunk, now() - t, done, -1);
+	fifo_destroy(&f);
+}
+
+
+/** fifo_copy from one fifo into another, chunk bytes at a time */
+
+static void bench_copy(int size, int chunk, char *buf)
+{
+	struct fifo src, dst;
+	long done;
+	double t;
+
+	fifo_setup(&src, size);
+	fifo_setup(&dst, size);
+	t = now();
+	for(done=0; done<bytes; done+=chunk) {
+		fifo_unsafe_append(&src, buf, chunk);
+		fifo_copy(&src, &dst);
+		fifo_clear(&dst);
+	}
+	report("copy", "mem", size, chunk, now() - t, done, -1);
+	fifo_destroy(&src);
+	fifo_destroy(&dst);
+}
+
+
+/** scan_find2 through text with a '*' every 4K, chunk bytes at a
+ *  time, with each kernel this cpu can run.  Every kernel must find
+ *  the same bytes as the scalar one.
+ */
+
+static void bench_scan(int chunk)
+{
+	static const char *names[] = { "scalar", "sse2", "avx2", "avx512", NULL };
+	static const char text[] = "the quick brown fox jumps over the lay dog\r\n";
+	static char data[65536];
+	const char *cp, *ce, *p;
+	long done, found, want_found = -1;
+	double t;
+	int i, k;
+
+	for(i=0; i<(int)sizeof(data); i++) {
+		data[i] = (i % 4096 == 4095) ? '*' : text[i % (sizeof(text)-1)];
+	}
+
+	for(k=0; names[k]; k++) {
+		if(scan_use(names[k]) < 0) {
+			continue;
+		}
+
+		found = 0;
+		t = now();
+		for(done=0; done<bytes; done+=chunk) {
+			cp = data + done % (sizeof(data) - chunk + 1);
+			ce = cp + chunk;
+			for(p=cp; (p = scan_find2(p, ce, 'z', '*')) < ce; p++) {
+				found += 1;
+			}
+		}
+		report("scan", names[k], 0, chunk, now() - t, done, -1);
+
+		if(want_found >= 0 && found != want_found) {
+			fprintf(stderr, "scan %s found %ld, scalar found %ld!\n",
+					names[k], found, want_found);
+			exit(2);
+		}
+		want_found = found;
+	}
+}
+
+
+static void make_fds(const char *kind, int fds[2])
+{
+	int err;
+
+	if(strcmp(kind, "pipe") == 0) {
+		err = pipe(fds);
+	} else {
+		err = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	}
+	if(err < 0) {
+		perror(kind);
+		exit(2);
+	}
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+}
+
+
+static void forward_proc(struct filter *flt, const char *buf, int size, int fd)
+{
+	filter_pass(flt, buf, size);
+}
+
+
+/** fifo_write chunk bytes into an fd then fifo_read them back out.
+ *  The filter test does the same but through a forwarding filter.
+ */
+
+static void bench_rdwr(const char *test, const char *kind, int size, int chunk, char *buf)
+{
+	struct fifo out, in;
+	struct filter fwd;
+	long done, calls = 0;
+	int fds[2];
+	double t;
+
+	fifo_setup(&out, size);
+	fifo_setup(&in, size);
+	make_fds(kind, fds);
+
+	if(strcmp(test, "filter") == 0) {
+		filter_init(&fwd, forward_proc, NULL);
+		filter_install(&in, &fwd, NULL);
+	}
+
+	t = now();
+	for(done=0; done<bytes; ) {
+		while(fifo_avail(&out) >= chunk) {
+			fifo_unsafe_append(&out, buf, chunk);
+		}
+		if(fifo_write(&out, fds[1]) > 0) {
+			calls++;
+		}
+		while(fifo_read(&in, fds[0]) > 0) {
+			calls++;
+			done += fifo_count(&in);
+			fifo_clear(&in);
+		}
+		calls++;	// the read that returned EAGAIN
+	}
+	report(test, kind, size, chunk, now() - t, done, calls);
+
+	close(fds[0]);
+	close(fds[1]);
+	fifo_destroy(&out);
+	fifo_destroy(&in);
+}
+
+
+// State for the pipe test.  A producer writes chunks into one end
+// of src, a struct pipe moves them from src to dst, and a consumer
+// drains dst.
+
+static int pb_chunk;
+static long pb_sent, pb_received;
+static char *pb_buf;
+
+
+static void producer_proc(io_atom *atom, int flags)
+{
+	int cnt;
+
+	while(pb_sent < bytes) {
+		cnt = write(atom->fd, pb_buf, pb_chunk);
+		if(cnt <= 0) {
+			return;
+		}
+		pb_sent += cnt;
+	}
+
+	io_del(atom);
+	close(atom->fd);
+	atom->fd = -1;
+}
+
+
+static void consumer_proc(io_atom *atom, int flags)
+{
+	static char scratch[65536];
+	int cnt;
+
+	do {
+		cnt = read(atom->fd, scratch, sizeof(scratch));
+		if(cnt > 0) {
+			pb_received += cnt;
+		}
+	} while(cnt > 0);
+}
+
+
+/** Moves data through a struct pipe using the real event loop */
+
+static void bench_pipe(const char *kind, const char *backend,
+		int size, int chunk, char *buf)
+{
+	struct pipe pipe;
+	pipe_atom ratom, watom;
+	io_atom producer, consumer;
+	int src[2], dst[2];
+	long loops = 0;
+	char name[32];
+	double t;
+
+	io_use(backend);
+	io_init();
+	make_fds(kind, src);
+	make_fds(kind, dst);
+
+	pb_chunk = chunk;
+	pb_buf = buf;
+	pb_sent = pb_received = 0;
+
+	io_atom_init(&producer, src[1], producer_proc);
+	io_add(&producer, IO_WRITE);
+	io_atom_init(&consumer, dst[0], consumer_proc);
+	io_add(&consumer, IO_READ);
+
+	pipe_atom_init(&ratom, src[0]);
+	pipe_atom_init(&watom, dst[1]);
+	pipe_init(&pipe, &ratom, &watom, size, size);
+
+	t = now();
+	while(pb_received < bytes) {
+		io_wait(1000);
+		io_dispatch();
+		loops++;
+	}
+	snprintf(name, sizeof(name), "%s/%s", kind, backend);
+	report("pipe", name, size, chunk, now() - t, pb_received, loops);
+
+	if(ratom.atom.fd >= 0) {
+		pipe_atom_destroy(&ratom);
+		close(src[0]);
+	}
+	pipe_atom_destroy(&watom);
+	close(dst[1]);
+	io_del(&consumer);
+	close(dst[0]);
+	pipe_destroy(&pipe);
+	io_exit();
+}
+
+
+static void usage()
+{
+	printf(
+		"Usage: fifobench [-q] [-s] [-t TEST]\n"
+		"  -q: quick run, move less data through each test\n"
+		"  -s: don't splice, copy everything through the pipe's fifo\n"
+		"  -t: only run tests whose name contains TEST\n"
+		"      (scan, append, prepend, copy, rdwr, filter, pipe)\n"
+	);
+}
+
+
+int main(int argc, char **argv)
+{
+	static const char *kinds[] = { "pipe", "socket", NULL };
+	static const char *backends[] = { "select", "poll", "epoll", "epoll-et", "io_uring", NULL };
+	char *buf;
+	int c, i, j, k, b;
+
+	while((c = getopt(argc, argv, "hqst:")) != -1) {
+		switch(c) {
+			case 'q':
+				opt_bytes = 4*1024*1024;
+				break;
+			case 's':
+				pipe_splice = 0;
+				break;
+			case 't':
+				opt_test = optarg;
+				break;
+			case 'h':
+				usage();
+				exit(0);
+			default:
+				usage();
+				exit(exit_cmdline_error);
+		}
+	}
+
+	buf = malloc(chunk_sizes[sizeof(chunk_sizes)/sizeof(chunk_sizes[0]) - 2]);
+	if(buf == NULL) {
+		perror("malloc");
+		exit(2);
+	}
+
+	for(j=0; chunk_sizes[j] && want("scan"); j++) {
+		bytes = (long)chunk_sizes[j] * 1024 * 1024;
+		if(bytes > opt_bytes) {
+			bytes = opt_bytes;
+		}
+		bench_scan(chunk_sizes[j]);
+	}
+
+	for(i=0; fifo_sizes[i]; i++) {
+		for(j=0; chunk_sizes[j]; j++) {
+			int size = fifo_sizes[i], chunk = chunk_sizes[j];
+			if(chunk > size) {
+				continue;
+			}
+
+			// tiny chunks mean a syscall per byte so don't move as much
+			bytes = (long)chunk * 1024 * 1024;
+			if(bytes > opt_bytes) {
+				bytes = opt_bytes;
+			}
+
+			if(want("append")) bench_append(size, chunk, buf);
+			if(want("prepend")) bench_prepend(size, chunk, buf);
+			if(want("copy")) bench_copy(size, chunk, buf);
+			for(k=0; kinds[k]; k++) {
+				if(want("rdwr")) bench_rdwr("rdwr", kinds[k], size, chunk, buf);
+				if(want("filter")) bench_rdwr("filter", kinds[k], size, chunk, buf);
+				for(b=0; backends[b] && want("pipe"); b++) {
+					bench_pipe(kinds[k], backends[b], size, chunk, buf);
+				}
+			}
+		}
+	}
+
+	free(buf);
+
+	return 0;
+}
@@ -0,0 +1,445 @@
+/* filtertest.c
+ * Scott Bronson
+ *
+ * Tests fifo filter chains (filter.c): stages that pass, drop, inject
+ * and hold data, several stages in a row, installing and removing
+ * them mid-stream, and a filter in front of a proc that holds bytes
+ * (zrq_scan).  Every input is read with the packet boundaries at
+ * every possible spot, through a fifo small enough to wrap and through
+ * a mirrored one.
+ *
+ * Run "make test" in the top-level directory or "make filtertest" here.
+ * Prints each failure and exits nonzero if there were any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../fifo.h"
+#include "../filter.h"
+#include "../zseq.h"
+#include "../zrq.h"
+
+
+#define ZRQINIT "**\030B00"
+
+// small fifos are malloc'd and wrap, page-sized ones are mirrored
+static const int fifo_sizes[] = { 64, 4096, 0 };
+
+static int checks, failures;
+static int scratched;	// 1 if the last run had to move input out of the way
+
+
+// provided by rzh
+void bail(int val)
+{
+	fprintf(stderr, "bailed with %d\n", val);
+	exit(val);
+}
+
+
+static void check(int ok, const char *what, const char *name, int size, int split)
+{
+	checks += 1;
+	if(!ok) {
+		failures += 1;
+		if(split < 0) {
+			printf("FAIL %s: %s, %d byte fifo, a byte at a time\n", name, what, size);
+		} else {
+			printf("FAIL %s: %s, %d byte fifo, split at %d\n", name, what, size, split);
+		}
+	}
+}
+
+
+/* The packets that the input is cut into.  split -1 means one byte
+ * per packet, otherwise it's two packets split at that offset.
+ */
+
+static int next_packet(int len, int split, int pos)
+{
+	if(split < 0) {
+		return pos + 1;
+	}
+	return pos < split ? split : len;
+}
+
+
+static void pass_proc(struct filter *flt, const char *buf, int size, int fd)
+{
+	if(size > 0) {
+		filter_pass(flt, buf, size);
+	}
+}
+
+
+/** Trims: drops every 'x'. */
+
+static void drop_proc(struct filter *flt, const char *buf, int size, int fd)
+{
+	const char *cp, *cb = buf, *ce = buf + size;
+
+	for(cp=buf; cp<ce; cp++) {
+		if(*cp == 'x') {
+			filter_pass(flt, cb, cp - cb);
+			cb = cp + 1;
+		}
+	}
+	if(size > 0) {
+		filter_pass(flt, cb, ce - cb);
+	}
+}
+
+
+/** Injects: puts a '\r' in front of every '\n'. */
+
+static void crlf_proc(struct filter *flt, const char *buf, int size, int fd)
+{
+	const char *cp = buf, *cb = buf, *ce = buf + size;
+
+	for(; cp<ce; cp++) {
+		if(*cp == '\n') {
+			filter_pass(flt, cb, cp - cb);
+			filter_reserve(flt, &cp, &ce, 1);
+			filter_pass(flt, "\r", 1);
+			cb = cp;
+		}
+	}
+	if(size > 0) {
+		filter_pass(flt, cb, ce - cb);
+	}
+}
+
+
+/** Holds: turns a backslash-n into a newline.  A backslash at the end
+ *  of the input is held until the next call shows what follows it.
+ *  refcon points to an int that's 1 while a backslash is being held.
+ */
+
+static void unescape_proc(struct filter *flt, const char *buf, int size, int fd)
+{
+	int *held = (int*)flt->refcon;
+	const char *cp = buf, *cb, *ce = buf + size;
+
+	if(size <= 0) {
+		return;
+	}
+
+	if(*held) {
+		*held = 0;
+		filter_reserve(flt, &cp, &ce, 1);
+		if(*cp == 'n') {
+			filter_pass(flt, "\n", 1);
+			cp += 1;
+		} else {
+			filter_pass(flt, "\\", 1);
+		}
+	}
+
+	for(cb=cp; cp<ce; cp++) {
+		if(*cp != '\\') {
+			continue;
+		}
+		filter_pass(flt, cb, cp - cb);
+		if(cp + 1 == ce) {
+			*held = 1;
+			return;
+		}
+		if(cp[1] == 'n') {
+			filter_reserve(flt, &cp, &ce, 1);
+			filter_pass(flt, "\n", 1);
+			cp += 1;
+			cb = cp + 1;
+		} else {
+			cb = cp;
+		}
+	}
+	filter_pass(flt, cb, ce - cb);
+}
+
+
+static int eofs;
+
+static void eof_proc(struct filter *flt, const char *buf, int size, int fd)
+{
+	if(size <= 0) {
+		eofs += 1;
+	}
+	pass_proc(flt, buf, size, fd);
+}
+
+
+static void zrq_started(void *refcon)
+{
+}
+
+
+static void zrq_proc(struct fifo *f, const char *buf, int size, int fd)
+{
+	if(size > 0) {
+		zrq_scan(f->refcon, buf, buf+size, f, fd);
+	}
+}
+
+
+/* What a test sets up.  The filters are installed in order (each
+ * after the one before) and the first nremove of them are removed
+ * after the first packet.
+ */
+
+struct setup {
+	filter_proc procs[3];
+	int nremove;
+	int zrq;
+};
+
+
+/** Reads the input into a fifo through the filters, draining the
+ *  fifo after every read the way a writer would.  Fills in out and
+ *  returns how many bytes came out.
+ */
+
+static int run_filters(const struct setup *s, const char *in, int len,
+		int size, int split, char *out)
+{
+	struct fifo f;
+	struct filter flt[3];
+	int held[3] = { 0, 0, 0 };
+	int fds[2];
+	int pos = 0, end, n, i, outlen = 0;
+
+	if(pipe(fds) < 0 || !fifo_init(&f, size, size)) {
+		perror("filtertest setup");
+		exit(1);
+	}
+	// start near the end of the buffer so the data wraps
+	f.beg = f.end = size - 8;
+	if(s->zrq) {
+		f.proc = zrq_proc;
+		f.refcon = zrq_create(zrq_started, NULL);
+	}
+	for(i=0; i<3 && s->procs[i]; i++) {
+		filter_init(&flt[i], s->procs[i], &held[i]);
+		filter_install(&f, &flt[i], i ? &flt[i-1] : NULL);
+	}
+
+	while(pos < len) {
+		end = next_packet(len, split, pos);
+		if(write(fds[1], in + pos, end - pos) != end - pos) {
+			perror("filtertest write");
+			exit(1);
+		}
+		fifo_read(&f, fds[0]);
+		n = fifo_count(&f);
+		fifo_unsafe_unpend(&f, out + outlen, n);
+		outlen += n;
+
+		if(pos == 0) {
+			for(i=0; i<s->nremove; i++) {
+				filter_remove(&flt[i]);
+			}
+		}
+		pos = end;
+	}
+
+	for(i=0; i<3 && s->procs[i]; i++) {
+		filter_remove(&flt[i]);
+	}
+	if(s->zrq) {
+		zrq_destroy(f.refcon);
+	}
+	scratched = (f.scratch != NULL);
+	fifo_destroy(&f);
+	close(fds[0]);
+	close(fds[1]);
+
+	return outlen;
+}
+
+
+static void test_filter(const char *name, const struct setup *s,
+		const char *in, const char *want, int split)
+{
+	char out[256];
+	int i, n;
+
+	for(i=0; fifo_sizes[i]; i++) {
+		n = run_filters(s, in, strlen(in), fifo_sizes[i], split, out);
+		check(n == strlen(want) && memcmp(out, want, n) == 0,
+				"wrong output", name, fifo_sizes[i], split);
+	}
+}
+
+
+/** Runs every split.  The filters in s have to give the same output
+ *  no matter where the packets break.
+ */
+
+static void test_splits(const char *name, const struct setup *s,
+		const char *in, const char *want)
+{
+	int i, len = strlen(in);
+
+	for(i=0; i<=len; i++) {
+		test_filter(name, s, in, want, i);
+	}
+	test_filter(name, s, in, want, -1);
+}
+
+
+static void test_stages()
+{
+	static const struct {
+		const char *name;
+		struct setup s;
+		const char *in;
+		const char *want;
+	} t[] = {
+		{ "pass", { { pass_proc } }, "hello\nworld", "hello\nworld" },
+		{ "drop", { { drop_proc } }, "xhexlxlo xx\nxx", "hello \n" },
+		{ "drop everything", { { drop_proc } }, "xxxxx", "" },
+		{ "inject", { { crlf_proc } }, "\na\nb\n\nc", "\r\na\r\nb\r\n\r\nc" },
+		{ "hold", { { unescape_proc } }, "a\\nb\\\\n\\x\\", "a\nb\\\n\\x" },
+		{ "drop then inject", { { drop_proc, crlf_proc } }, "x\nax\nx", "\r\na\r\n" },
+		{ "hold then inject", { { unescape_proc, crlf_proc } }, "a\\nb\n", "a\r\nb\r\n" },
+		{ "inject then hold", { { crlf_proc, unescape_proc } }, "a\\nb\n", "a\nb\r\n" },
+		{ "three stages", { { pass_proc, unescape_proc, drop_proc } }, "x\\nx\\x", "\n\\" },
+		{ NULL }
+	};
+	int i;
+
+	for(i=0; t[i].name; i++) {
+		test_splits(t[i].name, &t[i].s, t[i].in, t[i].want);
+	}
+}
+
+
+/** Filters come and go without disturbing the others. */
+
+static void test_remove()
+{
+	static const char in[] = "xa\nxb\n";
+	struct setup s = { { drop_proc, crlf_proc }, 1 };
+
+	// the drop filter only sees the first packet
+	test_filter("remove", &s, in, "a\r\nxb\r\n", 3);
+	test_filter("remove", &s, in, "a\r\nxb\r\n", 2);
+	test_filter("remove", &s, in, "a\r\nb\r\n", 4);
+	test_filter("remove", &s, in, "a\r\nxb\r\n", -1);
+
+	// removing the last filter puts the fifo back on the fast path
+	s.procs[1] = NULL;
+	test_filter("remove all", &s, in, "a\nxb\n", 3);
+}
+
+
+/** A filter in front of zrq_scan mustn't change what it does.  zrq
+ *  holds partial ZRQINITs (fifo->held), which leaves a gap in front
+ *  of the input only when there are no filters.
+ */
+
+static void test_held()
+{
+	static const char *in[] = {
+		"ls **\030B0 y " ZRQINIT "after",
+		"r*z rz\r" ZRQINIT "tail",
+		"**\030B08 **\030",
+		NULL
+	};
+	struct setup plain = { { NULL }, 0, 1 };
+	struct setup filtered = { { pass_proc }, 0, 1 };
+	struct setup stages = { { pass_proc, pass_proc, pass_proc }, 0, 1 };
+	char want[256];
+	int i, j, n, len;
+
+	for(i=0; in[i]; i++) {
+		len = strlen(in[i]);
+		for(j=-1; j<=len; j++) {
+			// without filters, fifo_read leaves a gap for the held bytes
+			n = run_filters(&plain, in[i], len, 4096, j, want);
+			want[n] = '\0';
+			if(!strstr(in[i], ZRQINIT)) {
+				// (starting inserts a ZRQINIT, that can need room)
+				check(!scratched, "no room left for held bytes", "held", 4096, j);
+			}
+			test_filter("held", &filtered, in[i], want, j);
+			test_filter("held three stages", &stages, in[i], want, j);
+		}
+	}
+}
+
+
+/** Every stage hears about EOF. */
+
+static void test_eof()
+{
+	struct setup s = { { eof_proc, eof_proc, eof_proc } };
+	struct fifo f;
+	struct filter flt[3];
+	int fds[2], i;
+
+	if(pipe(fds) < 0 || !fifo_init(&f, 64, 64)) {
+		perror("filtertest setup");
+		exit(1);
+	}
+	for(i=0; i<3; i++) {
+		filter_init(&flt[i], s.procs[i], NULL);
+		filter_install(&f, &flt[i], i ? &flt[i-1] : NULL);
+	}
+
+	eofs = 0;
+	close(fds[1]);
+	check(fifo_read(&f, fds[0]) == -2, "no eof", "eof", 64, 0);
+	check(eofs == 3, "a stage missed the eof", "eof", 64, 0);
+	check(fifo_count(&f) == 0, "eof left data", "eof", 64, 0);
+
+	close(fds[0]);
+	fifo_destroy(&f);
+}
+
+
+/** fifo_refeed runs data that's already in the fifo through filters
+ *  that were installed after it arrived.
+ */
+
+static void test_refeed()
+{
+	struct fifo f;
+	struct filter flt;
+	char out[64];
+	int n;
+
+	if(!fifo_init(&f, 64, 64)) {
+		perror("filtertest setup");
+		exit(1);
+	}
+
+	fifo_unsafe_append(&f, "keep", 4);
+	fifo_unsafe_append(&f, "xa\nx", 4);
+	filter_init(&flt, drop_proc, NULL);
+	filter_install(&f, &flt, NULL);
+	n = fifo_refeed(&f, f.end - 4, 0);
+	check(n == 2, "wrong count", "refeed", 64, 0);
+
+	n = fifo_count(&f);
+	fifo_unsafe_unpend(&f, out, n);
+	check(n == 6 && memcmp(out, "keepa\n", 6) == 0, "wrong output", "refeed", 64, 0);
+
+	filter_remove(&flt);
+	fifo_destroy(&f);
+}
+
+
+int main(int argc, char **argv)
+{
+	test_stages();
+	test_remove();
+	test_held();
+	test_eof();
+	test_refeed();
+
+	printf("filtertest: %d checks, %d failures\n", checks, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+/* pipetest.c
+ * Scott Bronson
+ *
+ * Tests that a struct pipe keeps moving data through the real event
+ * loop: the watermarks and the coalescing dirty list have to agree
+ * on when reading stops and starts again.
+ *
+ * Run "make test" in the top-level directory or "make pipetest" here.
+ * Prints each failure and exits nonzero if there were any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../chain.h"
+#include "../fifo.h"
+#include "../io/io.h"
+#include "../pipe.h"
+
+
+static const char *backends[] = { "select", "poll", "epoll", "epoll-et", "io_uring", NULL };
+
+static int checks, failures;
+
+
+// provided by rzh
+void bail(int val)
+{
+	fprintf(stderr, "bailed with %d\n", val);
+	exit(val);
+}
+
+
+static void check(int ok, const char *what, const char *name, const char *backend, int round)
+{
+	checks += 1;
+	if(!ok) {
+		failures += 1;
+		printf("FAIL %s: %s, %s round %d\n", name, what, backend, round);
+	}
+}
+
+
+static void make_fds(int fds[2])
+{
+	if(pipe(fds) < 0) {
+		perror("pipetest pipe");
+		exit(1);
+	}
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+}
+
+
+/** Turns the event loop the way rzh's main loop does until size bytes
+ *  come out the far end of the pipe or it gives up waiting.
+ *
+ *  @returns the number of bytes that came out.
+ */
+
+static int pump(int fd, int size)
+{
+	char buf[4096];
+	int got = 0, cnt, i;
+
+	for(i=0; i<20 && got < size; i++) {
+		io_wait(20);
+		io_dispatch();
+		pipe_flush_dirty();
+		while((cnt = read(fd, buf, sizeof(buf))) > 0) {
+			got += cnt;
+		}
+	}
+
+	return got;
+}
+
+
+/** Writes chunk bytes into the pipe every round and makes sure they
+ *  all come out before the next round.
+ */
+
+static void run_pipe(const char *name, const char *backend, int coalesce,
+		int low, int high, int chunk, int rounds)
+{
+	struct pipe pipe;
+	pipe_atom ratom, watom;
+	int src[2], dst[2];
+	char *buf;
+	int i;
+
+	io_use(backend);
+	io_init();
+	make_fds(src);
+	make_fds(dst);
+
+	pipe_atom_init(&ratom, src[0]);
+	pipe_atom_init(&watom, dst[1]);
+	pipe_init(&pipe, &ratom, &watom, 4096, 65536);
+	pipe_set_watermarks(&pipe, low, high);
+	pipe.coalesce = coalesce;
+
+	buf = malloc(chunk);
+	memset(buf, 'x', chunk);
+
+	for(i=0; i<rounds; i++) {
+		if(write(src[1], buf, chunk) != chunk) {
+			perror("pipetest write");
+			exit(1);
+		}
+		check(pump(dst[0], chunk) == chunk, "data stuck in the pipe", name, backend, i);
+		check(!pipe.block_read, "reading still blocked", name, backend, i);
+	}
+
+	free(buf);
+	pipe_atom_destroy(&ratom);
+	pipe_atom_destroy(&watom);
+	pipe_destroy(&pipe);
+	close(src[0]);
+	close(src[1]);
+	close(dst[0]);
+	close(dst[1]);
+	io_exit();
+}
+
+
+/** Data written to an fd right before it's deleted and closed has to
+ *  come out anyway.  io_uring may still have it queued.
+ */
+
+static void run_closed(const char *backend)
+{
+	io_atom atom;
+	char buf[64];
+	int fds[2];
+	int cnt, got = 0;
+
+	io_use(backend);
+	io_init();
+	make_fds(fds);
+
+	io_atom_init(&atom, fds[1], NULL);
+	io_add(&atom, 0);
+	check(io_write(fds[1], "goodbye", 7) == 7, "write failed", "closed", backend, 0);
+	io_del(&atom);
+	close(fds[1]);
+
+	io_wait(20);
+	io_dispatch();
+	while((cnt = read(fds[0], buf + got, sizeof(buf) - got)) > 0) {
+		got += cnt;
+	}
+	check(got == 7 && memcmp(buf, "goodbye", 7) == 0, "data lost", "closed", backend, 0);
+	check(cnt == 0, "no eof", "closed", backend, 0);
+
+	close(fds[0]);
+	io_exit();
+}
+
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	// the splice path never touches the fifo so the watermarks
+	// don't come into it.
+	pipe_splice = 0;
+
+	for(i=0; backends[i]; i++) {
+		run_pipe("plain", backends[i], 0, 0, 2048, 3000, 4);
+		// a coalescing pipe that goes over its high water mark gets
+		// drained by pipe_flush_dirty, not by an IO_WRITE event.
+		run_pipe("coalesce", backends[i], 1, 0, 2048, 3000, 4);
+		run_pipe("coalesce under", backends[i], 1, 0, 2048, 1000, 4);
+		run_pipe("coalesce over max", backends[i], 1, 0, 2048, 20000, 4);
+		run_closed(backends[i]);
+	}
+
+	printf("pipetest: %d checks, %d failures\n", checks, failures);
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,381 @@
+/* zseqtest.c
+ * Scott Bronson
+ *
+ * Tests the zmodem sequence recognizer (zseq.c) and the ZRQINIT
+ * scanner and OO suppression built on it (zrq.c and zfin.c).  Every input is fed with the packet
+ * boundaries at every possible spot: split in two at each byte, then
+ * one byte at a time.
+ *
+ * Run "make test" in the top-level directory or "make zseqtest" here.
+ * Prints each failure and exits nonzero if there were any.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "../chain.h"
+#include "../fifo.h"
+#include "../io/io.h"
+#include "../pipe.h"
+#include "../task.h"
+#include "../zseq.h"
+#include "../zrq.h"
+#include "../zfin.h"
+
+
+#define ZRQINIT "**\030B00"
+#define ZRINIT "**\030B01"
+#define ZFIN "**\030B0800000000022d\r\212"
+#define ABORT "\030\030\030\030\030"
+
+static int checks, failures;
+
+
+// provided by rzh
+void bail(int val)
+{
+	fprintf(stderr, "bailed with %d\n", val);
+	exit(val);
+}
+
+
+// zfin_term would end the task
+void task_terminate(master_pipe *mp)
+{
+}
+
+
+static void check(int ok, const char *what, const char *name, int split)
+{
+	checks += 1;
+	if(!ok) {
+		failures += 1;
+		if(split < 0) {
+			printf("FAIL %s: %s, a byte at a time\n", name, what);
+		} else {
+			printf("FAIL %s: %s, split at %d\n", name, what, split);
+		}
+	}
+}
+
+
+/* The packets that the input is cut into.  split -1 means one byte
+ * per packet, otherwise it's two packets split at that offset.
+ */
+
+static int next_packet(int len, int split, int pos)
+{
+	if(split < 0) {
+		return pos + 1;
+	}
+	return pos < split ? split : len;
+}
+
+
+/** Runs the recognizer over the input and checks the first match. */
+
+static void run_seq(const char *name, const char *in, int len, int mask,
+		int want, int wantend, int wantlen, int split)
+{
+	zseq z;
+	const char *cp, *ce;
+	int pos = 0, end, found = 0, foundend = -1;
+
+	zseq_init(&z);
+	while(pos < len && !found) {
+		end = next_packet(len, split, pos);
+		cp = in + pos;
+		ce = in + end;
+		while(cp < ce && !found) {
+			found = zseq_run(&z, &cp, ce, mask);
+			foundend = cp - in;
+		}
+		pos = end;
+	}
+
+	check(found == want, "wrong sequence", name, split);
+	if(found && found == want) {
+		check(foundend == wantend, "wrong end", name, split);
+		check(z.len == wantlen, "wrong length", name, split);
+	}
+}
+
+
+static void test_seq(const char *name, const char *in, int len, int mask,
+		int want, int wantend, int wantlen)
+{
+	int i;
+
+	for(i=0; i<=len; i++) {
+		run_seq(name, in, len, mask, want, wantend, wantlen, i);
+	}
+	run_seq(name, in, len, mask, want, wantend, wantlen, -1);
+}
+
+
+static void test_sequences()
+{
+	static const struct {
+		const char *name;
+		const char *in;
+		int mask;
+		int want;
+		int wantend;	// offset just past the match
+		int wantlen;
+	} t[] = {
+		{ "zrqinit", "xy" ZRQINIT "zz", ZSEQ_ZRQINIT, ZSEQ_ZRQINIT, 8, 6 },
+		{ "zrqinit after stray *", "***\030B0**\030B00", ZSEQ_ZRQINIT, ZSEQ_ZRQINIT, 12, 6 },
+		{ "zrinit", "q" ZRINIT "OO", ZSEQ_ZRQINIT, 0, 0, 0 },
+		{ "zfin", "a*" ZFIN "OO", ZSEQ_ZFIN|ZSEQ_OO, ZSEQ_ZFIN, 22, 20 },
+		{ "zfin masked out", "a*" ZFIN, ZSEQ_ZRQINIT|ZSEQ_ABORT, 0, 0, 0 },
+		{ "abort", "\030\030zz\030X\030X" ABORT "\010", ZSEQ_ABORT|ZSEQ_ZFIN, ZSEQ_ABORT, 13, 5 },
+		{ "long abort", "\030\030\030\030\030\030\030\030", ZSEQ_ABORT, ZSEQ_ABORT, 5, 5 },
+		{ "zdle escapes", "\030X\030X\030\030\030\030X", ZSEQ_ABORT, 0, 0, 0 },
+		{ "oo", "xO*OOx", ZSEQ_OO, ZSEQ_OO, 5, 2 },
+		{ "rz cr", "ls\rrz\r" ZRQINIT "0000", ZSEQ_ZRQINIT|ZSEQ_RZ, ZSEQ_RZ, 12, 9 },
+		{ "rz lf", "rz\n" ZRQINIT, ZSEQ_ZRQINIT|ZSEQ_RZ, ZSEQ_RZ, 9, 9 },
+		{ "rz crlf", "rrz\r\n" ZRQINIT, ZSEQ_ZRQINIT|ZSEQ_RZ, ZSEQ_RZ, 11, 10 },
+		{ "rz without rz", "rz\r" ZRQINIT, ZSEQ_ZRQINIT, ZSEQ_ZRQINIT, 9, 6 },
+		{ NULL }
+	};
+	int i;
+
+	for(i=0; t[i].name; i++) {
+		test_seq(t[i].name, t[i].in, strlen(t[i].in), t[i].mask,
+				t[i].want, t[i].wantend, t[i].wantlen);
+	}
+}
+
+
+static void test_hold()
+{
+	static const char in[] = "xrz\r**\030";
+	const char *cp = in, *ce = in + sizeof(in) - 1;
+	zseq z;
+
+	zseq_init(&z);
+	while(cp < ce) {
+		check(!zseq_run(&z, &cp, ce, ZSEQ_ZRQINIT|ZSEQ_RZ), "early match", "hold", 0);
+	}
+	check(zseq_depth(&z) == 6, "wrong depth", "hold", 0);
+	check(zseq_hold(&z, ZSEQ_ZRQINIT|ZSEQ_RZ) == 6, "rz dropped", "hold", 0);
+	check(zseq_hold(&z, ZSEQ_ZRQINIT) == 3, "wrong hold", "hold", 0);
+	check(memcmp(zseq_str(&z), "**\030", 3) == 0, "wrong held bytes", "hold", 0);
+	check(zseq_hold(&z, ZSEQ_ZFIN|ZSEQ_ZRQINIT) == 3, "hold grew", "hold", 0);
+
+	cp = "B00";
+	check(zseq_run(&z, &cp, cp+3, ZSEQ_ZRQINIT) == ZSEQ_ZRQINIT, "held match lost", "hold", 0);
+}
+
+
+static int started;
+
+static void zrq_started(void *refcon)
+{
+	started += 1;
+}
+
+
+static void zrq_proc(struct fifo *f, const char *buf, int size, int fd)
+{
+	if(size > 0) {
+		zrq_scan(f->refcon, buf, buf+size, f, fd);
+	}
+}
+
+
+/** Reads the packets into a fifo with zrq_scan as its proc, the way
+ *  the echo task does, and compares what the fifo ends up with.
+ */
+
+static void run_zrq(const char *name, const char *in, int len,
+		const char *want, int wantlen, int wantstarts, int split)
+{
+	struct fifo f;
+	int fds[2];
+	int pos = 0, end, n;
+	char *out;
+
+	if(pipe(fds) < 0 || !fifo_init(&f, 4096, 4096)) {
+		perror("zseqtest setup");
+		exit(1);
+	}
+	f.proc = zrq_proc;
+	f.refcon = zrq_create(zrq_started, NULL);
+	started = 0;
+
+	while(pos < len) {
+		end = next_packet(len, split, pos);
+		if(write(fds[1], in + pos, end - pos) != end - pos) {
+			perror("zseqtest write");
+			exit(1);
+		}
+		fifo_read(&f, fds[0]);
+		pos = end;
+	}
+
+	n = fifo_count(&f);
+	out = malloc(n + 1);
+	fifo_unsafe_unpend(&f, out, n);
+	check(n == wantlen && memcmp(out, want, n) == 0, "wrong output", name, split);
+	check(started == wantstarts, "wrong number of starts", name, split);
+	if(!wantstarts) {
+		// whatever is still held must be the tail of the input
+		n = zseq_depth(&((zscanstate*)f.refcon)->seq);
+		check(n <= len && memcmp(zseq_str(&((zscanstate*)f.refcon)->seq),
+				in + len - n, n) == 0, "wrong bytes held", name, split);
+	}
+
+	free(out);
+	zrq_destroy(f.refcon);
+	fifo_destroy(&f);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+
+static void test_zrq()
+{
+	// near misses that zrq has to hold on to, then give back in order
+	static const char misses[] = "r*z rz rz\rq **\030B0 *\030B00 ***\030B01 " ZFIN " **\030";
+	static const char pre[] = "$ ls\r\nfoo **\030B0 r ";
+	static const char rz[] = "rz\r";
+	static const char post[] = ZRQINIT "000000000000\r\212\021after";
+	static const char *stars[] = { "*", "ls *", "**", "a ***", "echo *.c *", "x**\030B0 **", NULL };
+	char in[256], want[256];
+	int i, j, n, len, plen = strlen(pre);
+
+	len = strlen(misses);
+	for(i=0; i<=len; i++) {
+		// the last packet can be held back entirely, put a
+		// terminator on so it comes out
+		snprintf(in, sizeof(in), "%s!", misses);
+		run_zrq("misses", in, len+1, in, len+1, 0, i);
+	}
+	run_zrq("misses", in, len+1, in, len+1, 0, -1);
+
+	// A trailing "**\030" stays held, except for any stars that came
+	// in an earlier packet.  They've already been let through.
+	for(i=0; i<=len; i++) {
+		n = (i <= len - 3 || i == len) ? len - 3 : i;
+		run_zrq("held misses", misses, len, misses, n, 0, i);
+	}
+	run_zrq("held misses", misses, len, misses, len - 1, 0, -1);
+
+	// a typed or echoed star has to show up right away
+	for(j=0; stars[j]; j++) {
+		len = strlen(stars[j]);
+		for(i=0; i<=len; i++) {
+			run_zrq("trailing stars", stars[j], len, stars[j], len, 0, i);
+		}
+		run_zrq("trailing stars", stars[j], len, stars[j], len, 0, -1);
+	}
+
+	// a ZRQINIT split after its stars is still found
+	snprintf(in, sizeof(in), "ab%stail", ZRQINIT);
+	len = strlen(in);
+	for(i=0; i<=len; i++) {
+		n = (i == 3 || i == 4) ? i - 2 : 0;
+		snprintf(want, sizeof(want), "ab%.*s%stail", n, "**", ZRQINIT);
+		run_zrq("split zrqinit", in, len, want, strlen(want), 1, i);
+	}
+
+	// The "rz\r" is dropped, but only if it came in a single packet.
+	// Otherwise the user may have typed it.
+	snprintf(in, sizeof(in), "%s%s%s", pre, rz, post);
+	len = strlen(in);
+	for(i=0; i<=len; i++) {
+		if(i > plen && i < plen + 3) {
+			run_zrq("rz split", in, len, in, len, 1, i);
+		} else {
+			snprintf(want, sizeof(want), "%s%s", pre, post);
+			run_zrq("rz", in, len, want, strlen(want), 1, i);
+		}
+	}
+	// The stars went out before the ZDLE showed up.  The receiver
+	// still gets the whole ZRQINIT.
+	snprintf(want, sizeof(want), "%s%s**%s", pre, rz, post);
+	run_zrq("rz byte at a time", in, len, want, strlen(want), 1, -1);
+}
+
+
+/** Feeds the packets to zfin_nooo, the way the master output fifo
+ *  does after a ZFIN, and compares what it saved.
+ */
+
+static void run_nooo(const char *name, const char *in, int len,
+		const char *want, int split)
+{
+	struct fifo f;
+	zfinscanstate *state;
+	struct iovec iov[16];
+	int pos = 0, end, n, cnt, i;
+	char out[256];
+
+	if(!fifo_init(&f, 256, 256)) {
+		perror("zseqtest setup");
+		exit(1);
+	}
+	state = zfin_create(NULL, zfin_nooo, NULL);
+	f.proc = zfin_nooo;
+	f.refcon = state;
+
+	while(pos < len) {
+		end = next_packet(len, split, pos);
+		(*f.proc)(&f, in + pos, end - pos, 0);
+		pos = end;
+	}
+
+	n = 0;
+	cnt = chain_iov(&state->save, iov, 16);
+	for(i=0; i<cnt; i++) {
+		memcpy(out + n, iov[i].iov_base, iov[i].iov_len);
+		n += iov[i].iov_len;
+	}
+	check(n == chain_count(&state->save), "chain too long", name, split);
+	check(n == strlen(want) && memcmp(out, want, n) == 0, "wrong output", name, split);
+
+	zfin_destroy(state);
+	fifo_destroy(&f);
+}
+
+
+static void test_nooo()
+{
+	static const struct {
+		const char *name;
+		const char *in;
+		const char *want;
+	} t[] = {
+		{ "oo", "OO$ ", "$ " },
+		{ "no oo", "$ ", "$ " },
+		{ "one o", "O$ OO", "O$ OO" },
+		{ "ooo", "OOO", "O" },
+		{ "late oo", "\r\nOO", "\r\nOO" },
+		{ NULL }
+	};
+	int i, j, len;
+
+	for(i=0; t[i].name; i++) {
+		len = strlen(t[i].in);
+		for(j=0; j<=len; j++) {
+			run_nooo(t[i].name, t[i].in, len, t[i].want, j);
+		}
+		run_nooo(t[i].name, t[i].in, len, t[i].want, -1);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	test_sequences();
+	test_hold();
+	test_zrq();
+	test_nooo();
+
+	printf("zseqtest: %d checks, %d failures\n", checks, failures);
+	return failures ? 1 : 0;
+}
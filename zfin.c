@@ -36,14 +36,21 @@
  * 		So the master actually cycles through 3 procs while scanning:
  * 			zfin_scan -> zfin_nooo -> zfin_save
  * 		Then, in the destructor, we copy the saved data back into the output pipe.
+ *
+ *  An abort (5 CANs) in either direction is passed along, then the
+ *  state's aborted proc tears the transfer down right away (see
+ *  rztask.c) instead of waiting for the child to notice.
  */
 
 
 #include "log.h"
+#include "chain.h"
 #include "fifo.h"
 #include "io/io.h"
 #include "pipe.h"
+#include "scan.h"
 #include "task.h"
+#include "zseq.h"
 #include "zfin.h"
 #include "util.h"
 
@@ -55,7 +62,8 @@
 
 
 zfinscanstate* zfin_create(master_pipe *mp,
-		void (*proc)(struct fifo *f, const char *buf, int size, int fd))
+		void (*proc)(struct fifo *f, const char *buf, int size, int fd),
+		void (*abort)(struct fifo *f, const char *buf, int size, int fd))
 {
     zfinscanstate *state;
 
@@ -68,6 +76,8 @@ zfinscanstate* zfin_create(master_pipe *mp,
 
 	state->master = mp;
 	state->found = proc;
+	state->aborted = abort;
+	chain_init(&state->save);
 
     return state;
 
@@ -76,9 +86,7 @@ zfinscanstate* zfin_create(master_pipe *mp,
 
 void zfin_destroy(zfinscanstate *state)
 {
-	if(state->savebuf) {
-		free(state->savebuf);
-	}
+	chain_destroy(&state->save);
 	free(state);
 }
 
@@ -89,19 +97,17 @@ void zfin_destroy(zfinscanstate *state)
 void zfin_scan(struct fifo *f, const char *buf, int size, int fd)
 {
 	log_warn("enter: size=%d refcon=%08lX", size, (long)f->refcon);
-	int ofe = f->end;
+	uint64_t ofe = f->end;
 	orig_zfin_scan(f, buf, size, fd);
-	int nfe = f->end;
+	uint64_t nfe = f->end;
 
-	if(nfe >= ofe) {
-		if(nfe - ofe != size) {
-			log_warn("sizes differ!");
-		} else if(memcmp(f->buf+ofe, buf, size) != 0) {
-			log_warn("contents differ!");
-		}
-	} else {
+	if(nfe - ofe != size) {
+		log_warn("sizes differ!");
+	} else if(fifo_index(f, ofe) + size > f->size && !f->mirrored) {
 		// skip this for now
 		log_warn("wrap!");
+	} else if(memcmp(f->buf+fifo_index(f, ofe), buf, size) != 0) {
+		log_warn("contents differ!");
 	}
 }
 
@@ -112,107 +118,105 @@ void zfin_scan(struct fifo *f, const char *buf, int size, int fd)
 
 void zfin_scan(struct fifo *f, const char *buf, int size, int fd)
 {
-	// technically this string should begin with "**".  however there's
-	// a boyer-mooreesque start problem: if the previous packet ends with
-	// "*", and the next packet is a ZFIN, this match algorightm won't
-	// find it.  It finds "**" (one star from prevous packet, one star
-	// from the next packet), fails to match \030 against the second star
-	// in the second packet, and starts over.  But now we only have one
-	// star!  The proper way is to implement a complex restart procedure.
-	// Much easier, though, to just search for the single star.  Since it's
-	// impossible for this sequence to be anywhere in a zmodem transfer
-	// OTHER than a ZFIN packet, it's an adequate workaround.
-
-	static const char zfin[] = "*\030B0800000000022d\015\212";
+	// zseq handles restarts properly so a ZFIN that follows a stray
+	// '*' (even one at the end of the previous packet) is still found.
+	// Nothing is ever held back: a ZFIN can't appear anywhere in a
+	// zmodem transfer other than at the end so the data just passes
+	// through while we watch.
+	//
+	// The same goes for an abort (5 CANs).  CAN is also ZDLE, but an
+	// escaped stream never has two ZDLEs in a row, so it can't be data.
 
 	zfinscanstate *state = (zfinscanstate*)f->refcon;
-	const char *ref = state->ref;
-	const char *cp, *ce;
+	const char *cp = buf, *ce = buf + size;
+	int found;
 
 	if(size <= 0) {
 		return;
 	}
-	
-	for(;;) {
-		if(ref) {
-			cp = buf;
-//			log_dbg("zfin %d resuming string match at %d", fd, ref-zfin);
-		} else {
-//			log_dbg("zfin on %d: searching for '*' in %d bytes", fd, size);
-			cp = memchr(buf, '*', size);
-			if(!cp) {
-//				log_dbg("zfin on %d: '*' not found, returning entire buffer", fd);
-				// couldn't find the start char in the entire buffer.
-				fifo_unsafe_append(f, buf, size);
-				return;
-			}
 
-			// found the start char.  flush all the data up to the start char.
-			fifo_unsafe_append(f, buf, cp-buf);
-			size -= cp-buf;
-			buf = cp;
-			// and set up the state var
-			ref = zfin;
-		}
-		ce = buf + size;
-
-		while(cp < ce && *cp == *ref && ref < zfin+sizeof(zfin)-1) {
-			cp += 1;
-			ref += 1;
+	while(cp < ce) {
+		if(zseq_depth(&state->seq) == 0) {
+			cp = scan_find2(cp, ce, '*', '\030');
+			if(cp >= ce) {
+				break;
+			}
 		}
 
-		// append the data to the fifo no matter what.
-		fifo_unsafe_append(f, buf, cp-buf);
-		size -= cp-buf;
-		buf = cp;
-
-		if(*ref == 0) {
-			f->proc = state->found;
-			(*f->proc)(f, buf, size, fd);
-			return;
-		} else if(cp >= ce) {
-			// out of data, so we'll return and get called with more
-			state->ref = ref;
+		found = zseq_run(&state->seq, &cp, ce, ZSEQ_ZFIN|ZSEQ_ABORT);
+		if(found) {
+			fifo_unsafe_append(f, buf, cp-buf);
+			fifo_set_proc(f, found == ZSEQ_ABORT ? state->aborted : state->found);
+			(*f->proc)(f, cp, ce-cp, fd);
 			return;
-		} else if(*cp != *ref) {
-			// couldn't match.  append what we have so far.
-			ref = NULL;
-		} else {
-			assert(!"This should be unpossible!");
 		}
 	}
+
+	fifo_unsafe_append(f, buf, size);
 }
 
 #endif
 
 
-/** No OO: drops an optional OO, then passes the rest to zfinsave */
-// TODO: this doesn't appear to work 100%
+/** Peek proc for zfin_scan.  Everything up to the next '*' or CAN
+ *  passes through zfin_scan untouched, unless it's in the middle of
+ *  matching a ZFIN or abort (or has already found one and moved on to
+ *  another proc).
+ */
 
-void zfin_nooo(struct fifo *f, const char *buf, int size, int fd)
+int zfin_peek(struct fifo *f, const char *buf, int size)
 {
 	zfinscanstate *state = (zfinscanstate*)f->refcon;
+	const char *cp;
+
+	if(f->proc != zfin_scan || zseq_depth(&state->seq)) {
+		return 0;
+	}
+
+	cp = scan_find2(buf, buf+size, '*', '\030');
+	return cp - buf;
+}
+
 
-	while(size > 0) {
-		// move to the next routine if we've suppressed 2 Os
-		// or there are no more Os to be found.
-		if(*buf != 'O' || state->oocount >= 2) {
-			f->proc = zfin_save;
-			(*f->proc)(f, buf, size, fd);
+/** No OO: drops the optional "OO" that follows the ZFIN, then passes
+ *  the rest to zfin_save.  An 'O' at the end of a packet is held in
+ *  state->seq until we know whether the other one is coming.
+ */
+
+void zfin_nooo(struct fifo *f, const char *buf, int size, int fd)
+{
+	zfinscanstate *state = (zfinscanstate*)f->refcon;
+	const char *cp = buf, *ce = buf + size;
+	const char *held, *at;
+	int depth;
+
+	// Feed a byte at a time: the OO has to start right after the
+	// ZFIN, not just anywhere in what follows.
+	while(cp < ce) {
+		held = zseq_str(&state->seq);
+		depth = zseq_depth(&state->seq);
+		at = cp;
+		if(zseq_run(&state->seq, &cp, cp+1, ZSEQ_OO)) {
+			log_dbg("Dropped the OO after ZFIN on %d", fd);
+			fifo_set_proc(f, zfin_save);
+			(*f->proc)(f, cp, ce-cp, fd);
+			return;
+		}
+		if(zseq_depth(&state->seq) <= depth) {
+			// no OO, so give back whatever we were holding
+			zseq_init(&state->seq);
+			fifo_set_proc(f, zfin_save);
+			(*f->proc)(f, held, depth, fd);
+			(*f->proc)(f, at, ce-at, fd);
 			return;
 		}
-
-//		log_info("Dropped an O after ZFIN on %d", fd);
-		buf += 1;
-		size -= 1;
-		state->oocount += 1;
 	}
 }
 
 
-/** Saves all text in a dynamic buffer.  When the destructor is
- *  called, the saved text will be inserted into the pipe (now
- *  reconnected to the terminal instead of to the receive process).
+/** Saves all text in a chain.  When the destructor is called, the
+ *  chain is handed to the pipe (now reconnected to the terminal
+ *  instead of to the receive process).
  */
 
 void zfin_save(struct fifo *f, const char *buf, int size, int fd)
@@ -223,19 +227,8 @@ void zfin_save(struct fifo *f, const char *buf, int size, int fd)
 		return;
 	}
 
-	if(size + state->savecnt > state->savemax) {
-		state->savemax += size + 512;
-		log_info("Reallocing save buffer to %d bytes.", (int)state->savemax);
-		state->savebuf = realloc(state->savebuf, state->savemax);
-		if(state->savebuf == NULL) {
-			perror("reallocing savebuf");
-			bail(57);
-		}
-	}
-
 	log_info("SAVING %d bytes from %d: %s", size, fd, sanitize(buf, size));
-	memcpy(state->savebuf + state->savecnt, buf, size);
-	state->savecnt += size;
+	chain_append(&state->save, buf, size);
 }
 
 
@@ -245,7 +238,7 @@ void zfin_term(struct fifo *f, const char *buf, int size, int fd)
 
 	task_terminate(state->master);
 
-	f->proc = zfin_drop;
+	fifo_set_proc(f, zfin_drop);
 	(*f->proc)(f, buf, size, fd);
 }
 
@@ -8,9 +8,8 @@ typedef void (*zstart_proc)(void *refcon);
 
 
 typedef struct {
-	int parse_state;
-	enum { RZNONE, RZNL, RZCR, RZCRNL } gotrz;
-	int starcnt;
+	zseq seq;		// how much of a ZRQINIT we've seen
+	int held;		// how many bytes at the end of seq we're holding
 
 	zstart_proc start_proc;
 	void *start_refcon;
@@ -0,0 +1,90 @@
+/* zseq.c
+ * Scott Bronson
+ *
+ * Recognizes the zmodem control sequences that rzh cares about (see
+ * zseq.h) with one DFA.  The tables are generated by mkzseq.c when
+ * rzh is built.
+ *
+ * A match can be split over any number of calls and a mismatch never
+ * loses the start of another match (a ZFIN right after a stray '*',
+ * for instance).  Callers usually skip to a byte that can start a
+ * sequence on their own (see scan.h) and only run the DFA from there.
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+#include "zseq.h"
+#include "zseq_tab.h"
+
+
+/** Feeds the bytes starting at *cpp to the recognizer.  Stops when
+ *  a sequence in mask is complete, when the recognizer is back in its
+ *  start state (the caller can go back to skipping), or at ce.  Sets
+ *  *cpp to the first byte that wasn't consumed.
+ *
+ *  Returns the sequence that matched (z->len tells how long it was)
+ *  or 0.  After a match the recognizer starts over.
+ */
+
+int zseq_run(zseq *z, const char **cpp, const char *ce, int mask)
+{
+	const unsigned char *cp = (const unsigned char*)*cpp;
+	const unsigned char *end = (const unsigned char*)ce;
+	int s = z->state, t;
+
+	while(cp < end) {
+		s = zseq_next[s][*cp++];
+		if(zseq_out[s] & mask) {
+			// use the longest sequence in the mask that ends here
+			for(t=s; !(zseq_term[t] & mask); t=zseq_fail[t]) {
+				// (out says there's one)
+			}
+			z->state = 0;
+			z->len = zseq_depths[t];
+			*cpp = (const char*)cp;
+			return zseq_term[t] & mask;
+		}
+		if(s == 0) {
+			break;
+		}
+	}
+
+	z->state = s;
+	*cpp = (const char*)cp;
+	return 0;
+}
+
+
+/** Forgets as much of the partial match as can't become one of the
+ *  sequences in mask.  Returns how many bytes are still part of a
+ *  possible match.  They're zseq_str().
+ */
+
+int zseq_hold(zseq *z, int mask)
+{
+	int s = z->state;
+
+	while(s && !(zseq_reach[s] & mask)) {
+		s = zseq_fail[s];
+	}
+
+	z->state = s;
+	return zseq_depths[s];
+}
+
+
+/** The number of bytes in the current partial match. */
+
+int zseq_depth(const zseq *z)
+{
+	return zseq_depths[z->state];
+}
+
+
+/** The bytes of the current partial match. */
+
+const char* zseq_str(const zseq *z)
+{
+	return zseq_strs[z->state];
+}
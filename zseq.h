@@ -0,0 +1,35 @@
+/* zseq.h
+ * Scott Bronson
+ *
+ * This file is released under the MIT license.  This is basically the
+ * same as public domain, but absolves the author of liability.
+ */
+
+
+/* The sequences that zseq recognizes.  Each is a bit so the caller
+ * can pass a mask of the ones it cares about.
+ */
+
+enum {
+	ZSEQ_ZRQINIT = 0x01,	// "**\030B00", the sender wants to start
+	ZSEQ_ZFIN = 0x04,		// the complete ZFIN hex header
+	ZSEQ_ABORT = 0x08,		// five CANs
+	ZSEQ_OO = 0x10,			// "OO", the sender's over and out
+	ZSEQ_RZ = 0x20,			// "rz\r" or "rz\n" (or both) then a ZRQINIT
+};
+
+
+/* Tracks a partial match across calls.  Zero it to start. */
+
+typedef struct {
+	int state;
+	int len;		// the length of the last match
+} zseq;
+
+#define zseq_init(z) ((z)->state=0)
+
+
+int zseq_run(zseq *z, const char **cpp, const char *ce, int mask);
+int zseq_hold(zseq *z, int mask);
+int zseq_depth(const zseq *z);
+const char* zseq_str(const zseq *z);